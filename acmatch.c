@@ -0,0 +1,222 @@
+/************************************************************************
+ * acmatch.c - Multiple string matching (Aho-Corasick)
+ *
+ * The bm_match() routines look for one string at a time. When there are many
+ * strings to look for, it is better to build a single automaton for all of
+ * them, and then make a single pass over the text.
+ *
+ * The automaton is held as a trie with failure links. The edges are kept on
+ * chains, since most states have only one or two; the root has a full table.
+ */
+static char * sccs_id =  "@(#) $Name$ $Id$\n\
+Copyright (c) E2 Systems Limited 2009\n";
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acmatch.h"
+/*
+ * Allocate an empty table, with just the root state
+ */
+struct ac_table * ac_new()
+{
+struct ac_table * act;
+
+    if ((act = (struct ac_table *) calloc(1, sizeof(struct ac_table))) == NULL)
+        return NULL;
+    act->salloc = 256;
+    act->states = (struct ac_state *) malloc(sizeof(struct ac_state) *
+                                         act->salloc);
+    act->ealloc = 256;
+    act->edges = (struct ac_edge *) malloc(sizeof(struct ac_edge) *
+                                         act->ealloc);
+    act->walloc = 64;
+    act->word_len = (int *) malloc(sizeof(int) * act->walloc);
+    act->nstates = 1;
+    act->states[0].first_edge = -1;
+    act->states[0].fail = 0;
+    act->states[0].word = -1;
+    act->states[0].dict = -1;
+    return act;
+}
+/*
+ * Find the state an edge leads to, or -1 if there is no such edge
+ */
+static int ac_goto(act, state, c)
+struct ac_table * act;
+int state;
+unsigned char c;
+{
+int e;
+
+    for (e = act->states[state].first_edge;
+            e >= 0 && act->edges[e].c != c;
+                e = act->edges[e].sibling);
+    return (e < 0) ? -1 : act->edges[e].next_state;
+}
+/*
+ * Add a word to the table, and return its number. A word that is already in
+ * the table keeps the number it had. Empty words cannot be matched, and
+ * nothing can be added once the table has been compiled; -1 is returned.
+ */
+int ac_add(act, word, len)
+struct ac_table * act;
+char * word;
+int len;
+{
+int state;
+int next;
+unsigned char * xp;
+
+    if (len < 1 || act->compiled)
+        return -1;
+    for (state = 0, xp = (unsigned char *) word; len > 0; len--, xp++)
+    {
+        if ((next = ac_goto(act, state, *xp)) < 0)
+        {
+            if (act->nstates >= act->salloc)
+            {
+                act->salloc += act->salloc;
+                act->states = (struct ac_state *) realloc(act->states,
+                                 sizeof(struct ac_state) * act->salloc);
+            }
+            if (act->nedges >= act->ealloc)
+            {
+                act->ealloc += act->ealloc;
+                act->edges = (struct ac_edge *) realloc(act->edges,
+                                 sizeof(struct ac_edge) * act->ealloc);
+            }
+            next = act->nstates++;
+            act->states[next].first_edge = -1;
+            act->states[next].fail = 0;
+            act->states[next].word = -1;
+            act->states[next].dict = -1;
+            act->edges[act->nedges].c = *xp;
+            act->edges[act->nedges].next_state = next;
+            act->edges[act->nedges].sibling = act->states[state].first_edge;
+            act->states[state].first_edge = act->nedges++;
+        }
+        state = next;
+    }
+    if (act->states[state].word < 0)
+    {
+        if (act->nwords >= act->walloc)
+        {
+            act->walloc += act->walloc;
+            act->word_len = (int *) realloc(act->word_len,
+                                 sizeof(int) * act->walloc);
+        }
+        act->word_len[act->nwords] = xp - (unsigned char *) word;
+        act->states[state].word = act->nwords++;
+    }
+    return act->states[state].word;
+}
+/*
+ * Work out the failure links breadth first, so that a state's link is always
+ * known before those of the states below it.
+ */
+void ac_compile(act)
+struct ac_table * act;
+{
+int * queue;
+int head;
+int tail;
+int state;
+int next;
+int f;
+int e;
+int c;
+
+    queue = (int *) malloc(sizeof(int) * act->nstates);
+    head = 0;
+    tail = 0;
+    for (c = 0; c < 256; c++)
+        act->root_next[c] = 0;
+    for (e = act->states[0].first_edge; e >= 0; e = act->edges[e].sibling)
+    {
+        next = act->edges[e].next_state;
+        act->root_next[act->edges[e].c] = next;
+        act->states[next].fail = 0;
+        queue[tail++] = next;
+    }
+    while (head < tail)
+    {
+        state = queue[head++];
+        for (e = act->states[state].first_edge;
+                e >= 0;
+                    e = act->edges[e].sibling)
+        {
+            next = act->edges[e].next_state;
+            queue[tail++] = next;
+            for (f = act->states[state].fail;
+                    f != 0 && ac_goto(act, f, act->edges[e].c) < 0;
+                        f = act->states[f].fail);
+            if (f == 0)
+                f = act->root_next[act->edges[e].c];
+            else
+                f = ac_goto(act, f, act->edges[e].c);
+            act->states[next].fail = (f == next) ? 0 : f;
+            f = act->states[next].fail;
+            act->states[next].dict = (act->states[f].word >= 0) ? f :
+                                         act->states[f].dict;
+        }
+    }
+    free(queue);
+    act->compiled = 1;
+    return;
+}
+/*
+ * Find every occurrence of every word in the text from start up to and
+ * including last. The hits are put in an array that is grown as necessary,
+ * in order of where they end; the hits for any one word are therefore in order
+ * of where they start. Returns the number of hits.
+ */
+int ac_match(act, start, last, hitsp, allocp)
+struct ac_table * act;
+char * start;
+char * last;
+struct ac_hit ** hitsp;
+int * allocp;
+{
+unsigned char * xp;
+int state;
+int next;
+int out;
+int nhits = 0;
+
+    if (!act->compiled)
+        ac_compile(act);
+    for (state = 0, xp = (unsigned char *) start;
+            xp <= (unsigned char *) last;
+                xp++)
+    {
+        while (state != 0 && (next = ac_goto(act, state, *xp)) < 0)
+            state = act->states[state].fail;
+        state = (state == 0) ? act->root_next[*xp] : next;
+        for (out = (act->states[state].word >= 0) ? state :
+                       act->states[state].dict;
+                out > 0;
+                    out = act->states[out].dict)
+        {
+            if (nhits >= *allocp)
+            {
+                *allocp = (*allocp < 16) ? 16 : (*allocp + *allocp);
+                *hitsp = (struct ac_hit *) realloc(*hitsp,
+                                sizeof(struct ac_hit) * *allocp);
+            }
+            (*hitsp)[nhits].word = act->states[out].word;
+            (*hitsp)[nhits].p = ((char *) xp) -
+                                   act->word_len[act->states[out].word] + 1;
+            nhits++;
+        }
+    }
+    return nhits;
+}
+void ac_free(act)
+struct ac_table * act;
+{
+    free(act->states);
+    free(act->edges);
+    free(act->word_len);
+    free(act);
+    return;
+}
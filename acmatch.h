@@ -0,0 +1,48 @@
+/************************************************************************
+ * acmatch.h - Multiple string matching (Aho-Corasick)
+ *
+ * Any number of words are added to a table, which is then compiled. A single
+ * pass over some text then finds every occurrence of every word, overlapping
+ * or not. Adding the same word twice gives back the same word number.
+ *
+ * @(#) $Name$ $Id$ Copyright (c) E2 Systems Limited 2009
+ */
+#ifndef ACMATCH_H
+#define ACMATCH_H
+struct ac_edge {
+    int next_state;
+    int sibling;                /* Next edge out of the same state          */
+    unsigned char c;
+};
+struct ac_state {
+    int first_edge;             /* Chain of edges out of this state         */
+    int fail;                   /* Longest proper suffix that is a state    */
+    int word;                   /* Word ending at this state, or -1         */
+    int dict;                   /* Next state on the fail chain with a word */
+};
+struct ac_table {
+    int nstates;
+    int salloc;
+    struct ac_state * states;
+    int nedges;
+    int ealloc;
+    struct ac_edge * edges;
+    int nwords;
+    int walloc;
+    int * word_len;
+    int root_next[256];         /* The root state goes straight to the next */
+    int compiled;
+};
+/*
+ * Where a word was found
+ */
+struct ac_hit {
+    int word;
+    char * p;
+};
+struct ac_table * ac_new();
+int ac_add();
+void ac_compile();
+int ac_match();
+void ac_free();
+#endif
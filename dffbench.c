@@ -0,0 +1,614 @@
+/*
+ * dffbench.c - time the e2dfflib primitives on generated inputs
+ ***********************************************************************
+ * Options:
+ * -n  Operations in each pass (lines analysed, rows sorted ...; default 20000)
+ * -p  Passes over each case; the quickest is taken (default 5)
+ * -w  Write the results to this baseline file
+ * -r  Compare the results with this baseline file, flagging each case that
+ *     has slowed down by more than the threshold
+ * -t  The threshold, as a percentage (default 10)
+ ***********************************************************************
+ * The lines are generated with different numbers of fields, field widths,
+ * proportions of fields with escaped separators (and quotes) in them, and
+ * separators; a single one, which rec_anal() handles with escapes, and a pair,
+ * which it hands to strcspn(). The sorts are given keys in order, in reverse
+ * order, shuffled, and with only eight different values.
+ *
+ * Each case is reported as nanoseconds per operation. The baseline file is
+ * a delimited file like any other (CASE|NS_PER_OP), and is read back with
+ * e2dfflib. The exit status is 1 if a comparison found a case slower.
+ */
+static char * sccs_id =  "@(#) $Name$ $Id$\n\
+Copyright (c) E2 Systems Limited 2009\n";
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef LCC
+#include <unistd.h>
+#endif
+#include "e2conv.h"
+#include "e2dfflib.h"
+#ifdef LINUX
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+#ifndef LINUX
+char * strdup();
+#endif
+extern int optind;
+extern char * optarg;
+static char * usage = "Option -h outputs this message.\n\
+Option -n n does n operations in each pass (default 20000).\n\
+Option -p n takes the quickest of n passes over each case (default 5).\n\
+Option -w file writes the results to a baseline file.\n\
+Option -r file compares the results with a baseline file.\n\
+Option -t pct flags cases more than pct percent slower (default 10).\n";
+/*
+ * What the generated lines are like
+ */
+struct line_shape {
+    int fields;
+    int width;
+    int esc;                    /* Percentage of fields with an escape      */
+    char * fs;
+    char * fs_name;             /* For the case names, which can't have a | */
+};
+static struct line_shape shapes[] = {
+    {4, 8, 0, "|", "pipe"},
+    {4, 8, 10, "|", "pipe"},
+    {16, 16, 0, "|", "pipe"},
+    {16, 16, 10, "|", "pipe"},
+    {16, 16, 50, "|", "pipe"},
+    {64, 32, 0, "|", "pipe"},
+    {64, 32, 10, "|", "pipe"},
+    {16, 16, 0, "|,", "pipe-comma"},
+    {64, 32, 0, "|,", "pipe-comma"}};
+#define SORT_IN_ORDER  0
+#define SORT_REVERSED  1
+#define SORT_SHUFFLED  2
+#define SORT_DUPLICATE 3
+static char * sort_names[] = {"in-order", "reversed", "shuffled", "duplicate"};
+static int sql_cols[] = {4, 16, 64};
+/*
+ * The state the cases work on
+ */
+static int nops = 20000;
+static int npasses = 5;
+static char ** lines;           /* Generated lines, with their line feeds   */
+static FILE * line_fp;          /* The same lines, after a heading          */
+static char * heading;
+static struct row ** sort_rows_in;
+static char ** sort_keys_in;
+static char ** sort_keys;
+static struct file_control dfc;
+static struct row_track upd[2];
+static struct in_rec in_rec;
+#define RING 16
+static struct in_rec * ring;    /* Analysed lines for new_row()             */
+/*
+ * A repeatable random number generator, so that the inputs are the same from
+ * one run to the next
+ */
+static unsigned long bench_seed = 1;
+static unsigned long bench_rand()
+{
+    bench_seed = bench_seed * 1103515245UL + 12345UL;
+    return (bench_seed >> 16) & 0x7fff;
+}
+static double bench_now()
+{
+#ifdef LINUX
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec)/1000000000.0;
+#else
+struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + ((double) tv.tv_usec)/1000000.0;
+#endif
+}
+/*
+ * Generate a line of a given shape. An escaped field has an escaped
+ * separator and a quote in the middle of it.
+ */
+static char * gen_line(lsp, buf)
+struct line_shape * lsp;
+char * buf;
+{
+char * xp;
+int i;
+int j;
+
+    for (xp = buf, i = 0; i < lsp->fields; i++)
+    {
+        if (i > 0)
+            *xp++ = lsp->fs[i % strlen(lsp->fs)];
+        for (j = 0; j < lsp->width; j++)
+        {
+            if (j == lsp->width / 2 && bench_rand() % 100 < lsp->esc)
+            {
+                *xp++ = '\\';
+                *xp++ = lsp->fs[0];
+                *xp++ = '\'';
+            }
+            *xp++ = 'a' + bench_rand() % 26;
+        }
+    }
+    *xp++ = '\n';
+    *xp = '\0';
+    return strdup(buf);
+}
+/*
+ * Generate the lines for a shape, and write them to a file after a heading
+ */
+static void gen_lines(lsp)
+struct line_shape * lsp;
+{
+char * buf = (char *) malloc(lsp->fields * (lsp->width + 4) + 16);
+char * xp;
+int i;
+
+    if (lines != NULL)
+    {
+        for (i = 0; i < nops; i++)
+            free(lines[i]);
+        free(heading);
+        fclose(line_fp);
+    }
+    else
+        lines = (char **) malloc(sizeof(char *) * nops);
+    for (xp = buf, i = 0; i < lsp->fields; i++)
+        xp += sprintf(xp, (i == 0) ? "C%d" : "%cC%d",
+                        (i == 0) ? i : lsp->fs[i % strlen(lsp->fs)], i);
+    strcpy(xp, "\n");
+    heading = strdup(buf);
+    if ((line_fp = tmpfile()) == NULL)
+    {
+        perror("tmpfile()");
+        exit(1);
+    }
+    fputs(heading, line_fp);
+    for (i = 0; i < nops; i++)
+    {
+        lines[i] = gen_line(lsp, buf);
+        fputs(lines[i], line_fp);
+    }
+    fflush(line_fp);
+    free(buf);
+    return;
+}
+/*
+ * Give back rows read by get_rows()
+ */
+static void free_rows(rtp)
+struct row_track * rtp;
+{
+    zap_arena(rtp->arena);
+    rtp->arena = NULL;
+    free(rtp->rows);
+    rtp->rows = NULL;
+    rtp->recs = 0;
+    return;
+}
+/*
+ * The cases; each does nops operations
+ */
+static void b_rec_anal()
+{
+int i;
+
+    for (i = 0; i < nops; i++)
+    {
+        strcpy(in_rec.buf, lines[i]);
+        rec_anal(&in_rec);
+    }
+    return;
+}
+static void b_get_next()
+{
+    fseek(line_fp, (long) strlen(heading), SEEK_SET);
+    while (get_next(&in_rec, line_fp) != NULL);
+    return;
+}
+static void b_new_row()
+{
+int i;
+
+    for (i = 0; i < nops; i++)
+        free(new_row(&ring[i % RING]));
+    return;
+}
+static void b_get_rows()
+{
+    free_rows(&dfc.content.data);
+    fseek(line_fp, (long) strlen(heading), SEEK_SET);
+    get_rows(line_fp, &dfc.content.data);
+    return;
+}
+static void b_get_sizes()
+{
+    free(get_sizes(&dfc));
+    return;
+}
+static void b_quoterow()
+{
+int i;
+
+    for (i = 0; i < nops; i++)
+        free(quoterow(dfc.content.data.rows[i % dfc.content.data.recs], 0));
+    return;
+}
+static int str_comp(s1, s2, not_used)
+char * s1;
+char * s2;
+void * not_used;
+{
+    return strcmp(s1, s2);
+}
+static void b_qeng()
+{
+    memcpy(sort_keys, sort_keys_in, sizeof(char *) * nops);
+    qeng(sort_keys, nops, str_comp, NULL);
+    return;
+}
+static void b_sort_rows()
+{
+    memcpy(dfc.content.data.rows, sort_rows_in, sizeof(struct row *) * nops);
+    sort_rows(&dfc.content.data, "K");
+    return;
+}
+static void b_select_SQL()
+{
+int i;
+
+    for (i = 0; i < nops; i++)
+        free(get_open_select_SQL(dfc.content.data.col_defs, "BENCH_TABLE"));
+    return;
+}
+static void b_lookup_SQL()
+{
+int i;
+
+    for (i = 0; i < nops; i++)
+        free(create_lookup_SQL(dfc.content.data.col_defs, "BENCH_TABLE",
+                     dfc.content.data.col_defs));
+    return;
+}
+static void b_insert_SQL()
+{
+int i;
+
+    for (i = 0; i < nops; i++)
+        free(create_insert_SQL("BENCH_TABLE", dfc.content.data.col_defs));
+    return;
+}
+static void b_delete_SQL()
+{
+int i;
+
+    for (i = 0; i < nops; i++)
+        free(create_delete_SQL("BENCH_TABLE", dfc.content.data.col_defs));
+    return;
+}
+static void b_update_SQL()
+{
+int i;
+
+    for (i = 0; i < nops; i++)
+        free(create_custom_update_SQL("BENCH_TABLE", &upd[0], &upd[1]));
+    return;
+}
+static void b_where_fragment()
+{
+int i;
+char * xp;
+
+    for (i = 0; i < nops; i++)
+        if ((xp = where_fragment(dfc.content.data.col_defs->colp[i %
+                 dfc.content.data.col_defs->cols],
+                 (i & 1) ? "O'Brien%" : "Smith")) != NULL)
+            free(xp);
+    return;
+}
+/*
+ * The results, and the baseline they are compared with
+ */
+static FILE * base_fp;
+static struct file_control * base_fcp;
+static double threshold = 10.0;
+static int slower;
+/*
+ * Time a case, report it, and compare it with the baseline
+ */
+static void run_case(name, fun)
+char * name;
+void (*fun)();
+{
+double best = 0.0;
+double t;
+double ns;
+double was;
+int i;
+
+    for (i = 0; i < npasses; i++)
+    {
+        t = bench_now();
+        (*fun)();
+        t = bench_now() - t;
+        if (i == 0 || t < best)
+            best = t;
+    }
+    ns = best * 1000000000.0 / nops;
+    printf("%-40s %12.1f", name, ns);
+    if (base_fp != NULL)
+        fprintf(base_fp, "%s|%.1f\n", name, ns);
+    if (base_fcp != NULL)
+    {
+        for (i = 0; i < base_fcp->content.data.recs; i++)
+            if (!strcmp((char *) base_fcp->content.data.rows[i]->colp[0],
+                        name))
+                break;
+        if (i >= base_fcp->content.data.recs)
+            printf(" %12s", "new");
+        else
+        {
+            was = atof((char *) base_fcp->content.data.rows[i]->colp[1]);
+            printf(" %12.1f %+8.1f%%", was,
+                   (was > 0.0) ? 100.0 * (ns - was) / was : 0.0);
+            if (ns > was * (1.0 + threshold / 100.0))
+            {
+                fputs(" SLOWER", stdout);
+                slower++;
+            }
+        }
+    }
+    putchar('\n');
+    fflush(stdout);
+    return;
+}
+/*
+ * The line handling cases, for each shape of line
+ */
+static void line_cases()
+{
+struct line_shape * lsp;
+char name[64];
+char tag[40];
+int i;
+
+    ring = (struct in_rec *) calloc(RING, sizeof(struct in_rec));
+    for (lsp = shapes;
+             lsp < shapes + sizeof(shapes)/sizeof(struct line_shape);
+                 lsp++)
+    {
+        set_fs(lsp->fs);
+        gen_lines(lsp);
+        sprintf(tag, "f%dw%de%d/%s", lsp->fields, lsp->width, lsp->esc,
+                     lsp->fs_name);
+        for (i = 0; i < RING; i++)
+        {
+            strcpy(ring[i].buf, lines[i % nops]);
+            rec_anal(&ring[i]);
+        }
+        if (dfc.content.data.col_defs != NULL)
+            free(dfc.content.data.col_defs);
+        dfc.content.data.col_defs = col_defs(heading);
+        sprintf(name, "rec_anal/%s", tag);
+        run_case(name, b_rec_anal);
+        sprintf(name, "get_next/%s", tag);
+        run_case(name, b_get_next);
+        sprintf(name, "new_row/%s", tag);
+        run_case(name, b_new_row);
+        sprintf(name, "get_rows/%s", tag);
+        run_case(name, b_get_rows);
+        sprintf(name, "get_sizes/%s", tag);
+        run_case(name, b_get_sizes);
+        sprintf(name, "quoterow/%s", tag);
+        run_case(name, b_quoterow);
+        free_rows(&dfc.content.data);
+    }
+    set_fs("|");
+    return;
+}
+/*
+ * The sorts, for each order of keys. row_comp() compares the columns from the
+ * second on, whatever the sort order says, so the key goes there.
+ */
+static void sort_cases()
+{
+struct row_track * rtp = &dfc.content.data;
+char buf[64];
+char name[64];
+char * xp;
+int order;
+int i;
+int j;
+
+    sort_keys_in = (char **) malloc(sizeof(char *) * nops);
+    sort_keys = (char **) malloc(sizeof(char *) * nops);
+    sort_rows_in = (struct row **) malloc(sizeof(struct row *) * nops);
+    if (rtp->col_defs != NULL)
+        free(rtp->col_defs);
+    rtp->col_defs = col_defs("N|K|Y\n");
+    for (order = SORT_IN_ORDER; order <= SORT_DUPLICATE; order++)
+    {
+        for (i = 0; i < nops; i++)
+        {
+            j = (order == SORT_REVERSED) ? nops - 1 - i :
+                (order == SORT_DUPLICATE) ? (int) (bench_rand() % 8) : i;
+            sprintf(buf, "K%09d", j);
+            sort_keys_in[i] = strdup(buf);
+        }
+        if (order == SORT_SHUFFLED)
+            for (i = nops - 1; i > 0; i--)
+            {
+                j = (int) ((bench_rand() << 15 | bench_rand()) % (i + 1));
+                xp = sort_keys_in[i];
+                sort_keys_in[i] = sort_keys_in[j];
+                sort_keys_in[j] = xp;
+            }
+        for (i = 0; i < nops; i++)
+        {
+            sprintf(in_rec.buf, "%d|%s|%s\n", i, sort_keys_in[i],
+                         sort_keys_in[nops - 1 - i]);
+            rec_anal(&in_rec);
+            sort_rows_in[i] = new_row(&in_rec);
+        }
+        rtp->rows = (struct row **) malloc(sizeof(struct row *) * nops);
+        rtp->recs = nops;
+        sprintf(name, "qeng/%s", sort_names[order]);
+        run_case(name, b_qeng);
+        sprintf(name, "sort_rows/%s", sort_names[order]);
+        run_case(name, b_sort_rows);
+        for (i = 0; i < nops; i++)
+        {
+            free(sort_keys_in[i]);
+            free(sort_rows_in[i]);
+        }
+        free(rtp->rows);
+        rtp->rows = NULL;
+        rtp->recs = 0;
+    }
+    free(sort_keys_in);
+    free(sort_keys);
+    free(sort_rows_in);
+    return;
+}
+/*
+ * The SQL builders, for different numbers of columns. The two rows for the
+ * update differ in every other column.
+ */
+static void sql_cases()
+{
+struct row_track * rtp = &dfc.content.data;
+char name[64];
+char * xp;
+int n;
+int i;
+int j;
+
+    for (n = 0; n < sizeof(sql_cols)/sizeof(int); n++)
+    {
+        if (rtp->col_defs != NULL)
+            free(rtp->col_defs);
+        for (xp = in_rec.buf, i = 0; i < sql_cols[n]; i++)
+            xp += sprintf(xp, (i == 0) ? "COLUMN_%d" : "|COLUMN_%d", i);
+        strcpy(xp, "\n");
+        rtp->col_defs = col_defs(in_rec.buf);
+        for (j = 0; j < 2; j++)
+        {
+            upd[j].col_defs = rtp->col_defs;
+            upd[j].cur_row = 0;
+            upd[j].recs = 1;
+            for (xp = in_rec.buf, i = 0; i < sql_cols[n]; i++)
+                xp += sprintf(xp, (i == 0) ? "%d" : "|Value '%d'",
+                             (j == 1 && (i & 1)) ? i + 1000 : i);
+            strcpy(xp, "\n");
+            rec_anal(&in_rec);
+            upd[j].rows = (struct row **) malloc(sizeof(struct row *));
+            upd[j].rows[0] = new_row(&in_rec);
+        }
+        sprintf(name, "select_SQL/c%d", sql_cols[n]);
+        run_case(name, b_select_SQL);
+        sprintf(name, "lookup_SQL/c%d", sql_cols[n]);
+        run_case(name, b_lookup_SQL);
+        sprintf(name, "insert_SQL/c%d", sql_cols[n]);
+        run_case(name, b_insert_SQL);
+        sprintf(name, "delete_SQL/c%d", sql_cols[n]);
+        run_case(name, b_delete_SQL);
+        sprintf(name, "update_SQL/c%d", sql_cols[n]);
+        run_case(name, b_update_SQL);
+        sprintf(name, "where_fragment/c%d", sql_cols[n]);
+        run_case(name, b_where_fragment);
+        for (j = 0; j < 2; j++)
+        {
+            free(upd[j].rows[0]);
+            free(upd[j].rows);
+        }
+    }
+    return;
+}
+int main(argc, argv)
+int argc;
+char ** argv;
+{
+char * base_out = NULL;
+char * base_in = NULL;
+int c;
+
+    while ((c = getopt(argc, argv, "hn:p:w:r:t:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'n':
+            nops = atoi(optarg);
+            break;
+        case 'p':
+            npasses = atoi(optarg);
+            break;
+        case 'w':
+            base_out = optarg;
+            break;
+        case 'r':
+            base_in = optarg;
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        case 'h':
+        default:
+            fputs(usage, stderr);
+            exit(1);
+        }
+    }
+    if (nops < RING || npasses < 1 || threshold < 0.0)
+    {
+        fputs("Illegal number of operations, passes or threshold\n", stderr);
+        fputs(usage, stderr);
+        exit(1);
+    }
+/*
+ * Read the baseline before anything is written, in case it is the same file
+ */
+    if (base_in != NULL)
+    {
+        base_fcp = new_data_file_control(base_in, NULL);
+        if (base_fcp->content.data.col_defs == NULL)
+            exit(1);
+    }
+    if (base_out != NULL)
+    {
+        if ((base_fp = fopen(base_out, "wb")) == NULL)
+        {
+            fprintf(stderr, "Failed to open %s for write\n", base_out);
+            perror("fopen()");
+            exit(1);
+        }
+        fputs("CASE|NS_PER_OP\n", base_fp);
+    }
+    printf("%-40s %12s", "Case", "ns/op");
+    if (base_fcp != NULL)
+        printf(" %12s %9s", "Baseline", "Change");
+    putchar('\n');
+    line_cases();
+    sort_cases();
+    sql_cases();
+    if (base_fp != NULL && fclose(base_fp) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", base_out);
+        perror("fclose()");
+        exit(1);
+    }
+    if (slower > 0)
+    {
+        printf("%d case%s slower than the baseline by more than %.1f%%\n",
+                   slower, (slower == 1) ? "" : "s", threshold);
+        exit(1);
+    }
+    exit(0);
+}
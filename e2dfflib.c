@@ -10,7 +10,19 @@ Copyright (c) E2 Systems Limited 2009\n";
 #ifdef AIX
 #include <memory.h>
 #endif
+#ifdef LINUX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+#define LINE_SIMD
+#include <immintrin.h>
+#endif
 #include "e2dfflib.h"
+#include "fctrace.h"
 #ifndef LINUX
 char * strdup();
 #endif
@@ -36,8 +48,148 @@ char * get_fs()
     return FS;
 }
 /*
- * awk-like input line read routine. If the caller free()s the strdup()'ed
- * line buffer, the pointer to it must be set to NULL. 
+ * Find the separators (any of the characters in fs) in len bytes of a line,
+ * putting their offsets in seps, and stopping once max have been found.
+ * Returns how many were found. If escp isn't NULL, it is set to say whether
+ * there is an escape anywhere in the line.
+ *
+ * Where the compiler will let us, and there are no more than four separator
+ * characters, 32 or 16 bytes are looked at a time.
+ */
+static int find_seps(ls, len, fs, seps, max, escp)
+unsigned char * ls;
+int len;
+char * fs;
+unsigned int * seps;
+int max;
+int * escp;
+{
+int n = 0;
+int i = 0;
+int esc = 0;
+int nfs = strlen(fs);
+#ifdef LINE_SIMD
+unsigned int m;
+unsigned char f[4];
+
+    if (nfs <= 4 && max > 0)
+    {
+        for (n = 0; n < 4; n++)
+            f[n] = (n < nfs) ? fs[n] : fs[0];
+        n = 0;
+#ifdef __AVX2__
+        {
+        __m256i s0 = _mm256_set1_epi8(f[0]);
+        __m256i s1 = _mm256_set1_epi8(f[1]);
+        __m256i s2 = _mm256_set1_epi8(f[2]);
+        __m256i s3 = _mm256_set1_epi8(f[3]);
+        __m256i e = _mm256_set1_epi8('\\');
+        __m256i v;
+
+            for (; i + 32 <= len; i += 32)
+            {
+                v = _mm256_loadu_si256((__m256i *) (ls + i));
+                if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, e)))
+                    esc = 1;
+                m = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, s0),
+                                        _mm256_cmpeq_epi8(v, s1)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, s2),
+                                        _mm256_cmpeq_epi8(v, s3))));
+                for (; m != 0; m &= m - 1)
+                {
+                    seps[n++] = i + __builtin_ctz(m);
+                    if (n >= max)
+                    {
+                        i += __builtin_ctz(m) + 1;
+                        goto done;
+                    }
+                }
+            }
+        }
+#endif
+        {
+        __m128i s0 = _mm_set1_epi8(f[0]);
+        __m128i s1 = _mm_set1_epi8(f[1]);
+        __m128i s2 = _mm_set1_epi8(f[2]);
+        __m128i s3 = _mm_set1_epi8(f[3]);
+        __m128i e = _mm_set1_epi8('\\');
+        __m128i v;
+
+            for (; i + 16 <= len; i += 16)
+            {
+                v = _mm_loadu_si128((__m128i *) (ls + i));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, e)))
+                    esc = 1;
+                m = (unsigned int) _mm_movemask_epi8(_mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(v, s0),
+                                     _mm_cmpeq_epi8(v, s1)),
+                        _mm_or_si128(_mm_cmpeq_epi8(v, s2),
+                                     _mm_cmpeq_epi8(v, s3))));
+                for (; m != 0; m &= m - 1)
+                {
+                    seps[n++] = i + __builtin_ctz(m);
+                    if (n >= max)
+                    {
+                        i += __builtin_ctz(m) + 1;
+                        goto done;
+                    }
+                }
+            }
+        }
+    }
+#endif
+/*
+ * Whatever is left over
+ */
+    for (; i < len && n < max; i++)
+    {
+        if (ls[i] == '\\')
+            esc = 1;
+        else
+        if (memchr(fs, ls[i], nfs) != NULL)
+            seps[n++] = i;
+    }
+#ifdef LINE_SIMD
+done:
+#endif
+    if (escp != NULL)
+        *escp = esc || (i < len && memchr(ls + i, '\\', len - i) != NULL);
+    return n;
+}
+/*
+ * Split a line in place with a single character separator, without
+ * nextasc_r(), when that makes no difference; the line must end with a line
+ * feed, have no escapes in it and not have too many fields. Returns where the
+ * last field ends, or NULL, having changed nothing, if the line won't do.
+ */
+static char * split_plain(in_rec, len)
+struct in_rec * in_rec;
+int len;
+{
+unsigned int seps[1023];
+int esc;
+int n;
+int i;
+
+    if (len < 1 || in_rec->buf[len - 1] != '\n')
+        return NULL;
+    n = find_seps((unsigned char *) in_rec->buf, len, FS, seps, 1023, &esc);
+    if (esc || n >= 1023)
+        return NULL;
+    in_rec->fptr[1] = in_rec->buf;
+    for (i = 0; i < n; i++)
+    {
+        in_rec->buf[seps[i]] = '\0';
+        in_rec->fptr[i + 2] = &in_rec->buf[seps[i] + 1];
+    }
+    in_rec->fcnt = n + 1;
+    return &in_rec->buf[len - 1];
+}
+/*
+ * awk-like input line read routine. The line is copied to fptr[0]; the
+ * allocation is re-used by the next call. If the caller free()s the line
+ * buffer, the pointer to it must be set to NULL. 
  *
  * The separator is only one character.
  *
@@ -53,25 +205,34 @@ char *x;
 unsigned char * got_to;
 
     in_rec->fcnt = 0;
-    in_rec->fptr[0] = strdup(in_rec->buf);
-    if (in_rec->fptr[0][0] == '\0')
+    l = strlen(in_rec->buf);
+    if (in_rec->fptr[0] == NULL || in_rec->lalloc < l + 1)
+    {
+        if (in_rec->fptr[0] != NULL)
+            free(in_rec->fptr[0]);
+        in_rec->lalloc = (l < 128) ? 128 : (l + 1);
+        in_rec->fptr[0] = (char *) malloc(in_rec->lalloc);
+    }
+    memcpy(in_rec->fptr[0], in_rec->buf, l + 1);
+    if (l == 0)
         return in_rec;
 /*
  * This version, with a single match character, recognises \ as an escape.
- * This is why it is preserved.
+ * This is why it is preserved. Most lines have no escapes in them, though.
  */
+    if (FS[1] == '\0' && (x = split_plain(in_rec, l)) != NULL)
+        i = in_rec->fcnt + 1;
+    else
     if (FS[1] == '\0')
     {
-    char * src = strdup(in_rec->buf);
-
+/*
+ * fptr[0] is a copy of the line, so nextasc_r() can read from that
+ */
         x = &in_rec->buf[0];
-        in_rec->fptr[1] = nextasc_r(src, *FS, '\\', &got_to, x,
+        in_rec->fptr[1] = nextasc_r(in_rec->fptr[0], *FS, '\\', &got_to, x,
                  &in_rec->buf[sizeof(in_rec->buf)]);
         if (in_rec->fptr[1] == (char *) NULL)
-        {
-            free(src);
             return in_rec;
-        }
         i = 2;
         x += strlen(x);
         *x = '\0';
@@ -85,7 +246,6 @@ unsigned char * got_to;
             x++;
         }
         x -= 2;
-        free(src);
     }
     else
     {
@@ -131,8 +291,6 @@ char discard[1024];
     in_rec->buf[sizeof(in_rec->buf)-1] = '\0';
     if (fgets(in_rec->buf,sizeof(in_rec->buf) - 1, fp) == (char *) NULL)
         return (struct in_rec *) NULL;
-    if (in_rec->fptr[0] != (char *) NULL)
-        free(in_rec->fptr[0]);
     if (in_rec->buf[strlen(in_rec->buf) - 1] != '\n')
     {
         do
@@ -145,13 +303,73 @@ char discard[1024];
     }
     return rec_anal(in_rec);
 }
+/*
+ * Rows, and the text of indexed rows, are allocated from big chunks, so that
+ * there aren't millions of separate allocations scattered about the heap, and
+ * they can all be given back together.
+ */
+#define ARENA_CHUNK (1024 * 1024)
+struct row_arena {
+    struct row_arena * next;
+    unsigned long used;
+    unsigned long size;
+    double align;               /* What is allocated starts after this      */
+};
+void * arena_alloc(app, len)
+struct row_arena ** app;
+unsigned long len;
+{
+struct row_arena * ap = *app;
+struct row_arena * nap;
+unsigned long size;
+
+    len = (len + sizeof(double) - 1) & ~((unsigned long) sizeof(double) - 1);
+    if (ap == NULL || ap->used + len > ap->size)
+    {
+        size = (len > ARENA_CHUNK/4) ? len : ARENA_CHUNK;
+        if ((nap = (struct row_arena *) malloc(sizeof(struct row_arena)
+                       + size)) == NULL)
+            return NULL;
+        nap->size = size;
+        nap->used = 0;
+/*
+ * Something big gets a chunk to itself, behind the one being filled
+ */
+        if (ap != NULL && size == len)
+        {
+            nap->next = ap->next;
+            ap->next = nap;
+        }
+        else
+        {
+            nap->next = ap;
+            *app = nap;
+        }
+        ap = nap;
+    }
+    ap->used += len;
+    return (void *) (((char *) (ap + 1)) + ap->used - len);
+}
+void zap_arena(ap)
+struct row_arena * ap;
+{
+struct row_arena * nap;
+
+    for (; ap != NULL; ap = nap)
+    {
+        nap = ap->next;
+        free(ap);
+    }
+    return;
+}
 /*
  * Construct a data row from awk-like input in a single allocation
  * This code doesn't know about column definitions; it will allocate as few or
  * as many as there are.
  */
-struct row * new_row(in_rec)
+static struct row * build_row(in_rec, app)
 struct in_rec * in_rec;
+struct row_arena ** app;
 {
 struct row * rp;
 int col_len;
@@ -164,8 +382,10 @@ unsigned char * xp;
  */
     if (in_rec->fcnt == 0)
         return NULL;
-    if ((rp = malloc(sizeof(struct row) + 2* strlen(in_rec->fptr[0]) + 1 +
-              (in_rec->fcnt + 1) *sizeof(unsigned char *))) == NULL)
+    rec_len = sizeof(struct row) + 2* strlen(in_rec->fptr[0]) + 1 +
+              (in_rec->fcnt + 1) *sizeof(unsigned char *);
+    if ((rp = (app == NULL) ? malloc(rec_len) : arena_alloc(app, rec_len))
+              == NULL)
     {
         fputs("Not enough memory ...\n", stderr);
         return NULL;
@@ -184,6 +404,11 @@ unsigned char * xp;
     } 
     return rp;
 }
+struct row * new_row(in_rec)
+struct in_rec * in_rec;
+{
+    return build_row(in_rec, NULL);
+}
 /*
  * Create a set of column headings from a string rather than by reading
  * the first line of a file
@@ -192,11 +417,15 @@ struct row * col_defs(headings)
 char * headings;
 {
 struct in_rec in_rec;
+struct row * rp;
 
+    in_rec.fptr[0] = NULL;
     strncpy(in_rec.buf, headings, sizeof(in_rec.buf));
     in_rec.buf[sizeof(in_rec.buf) - 1] = '\0';
     rec_anal(&in_rec);
-    return new_row(&in_rec);
+    rp = new_row(&in_rec);
+    free(in_rec.fptr[0]);
+    return rp;
 }
 /*
  * Read some number of rows from a delimited file in to memory
@@ -209,7 +438,9 @@ struct in_rec in_rec;
 struct in_rec * cur_rec;
 int old_alloc;
 int i;
+FCT_DECL(t0)
 
+    FCT_START(t0);
     memset((unsigned char *) &in_rec, 0, sizeof(struct in_rec));
     if (rtp->recs > 0)
         rtp->alloc = rtp->recs;
@@ -227,6 +458,9 @@ int i;
             if ((cur_rec = get_next(&in_rec, fp)) == NULL)
             {
                 rtp->recs = i;
+                if (in_rec.fptr[0] != NULL)
+                    free(in_rec.fptr[0]);
+                FCT_SPAN("get_rows", NULL, i, t0);
                 return;
             }
 /*
@@ -237,10 +471,15 @@ int i;
  */
             if (in_rec.fcnt < rtp->col_defs->cols)
                 continue;
-            rtp->rows[i++] = new_row(&in_rec);
+            rtp->rows[i++] = build_row(&in_rec, &rtp->arena);
         }
         if (rtp->recs > 0)
+        {
+            if (in_rec.fptr[0] != NULL)
+                free(in_rec.fptr[0]);
+            FCT_SPAN("get_rows", NULL, i, t0);
             return;
+        }
         old_alloc = rtp->alloc;
         rtp->alloc = old_alloc + old_alloc;
         rtp->rows = (struct row **)
@@ -326,7 +565,9 @@ char **ptr_stack[128];
 int cnt_stack[128];
 int stack_level = 0;
 int i, j, l;
+FCT_DECL(t0)
 
+    FCT_START(t0);
     ptr_stack[0] = a1;
     cnt_stack[0] = cnt;
     stack_level = 1;
@@ -458,6 +699,7 @@ int i, j, l;
             stack_level++;
         }
     }
+    FCT_SPAN("qeng", NULL, cnt, t0);
     return;
 }
 /*
@@ -485,6 +727,29 @@ int * sortcon = (int *) malloc(sizeof(int) * (1 + sort_cols->cols));
     free(sortcon);
     return;
 }
+/*
+ * Read just the heading of a data file, if it has not been read already, so
+ * that its columns are known before any rows are wanted. Returns 0, without
+ * saying anything, if there isn't one; reading the rows will say why.
+ */
+int get_data_heading(fcp)
+struct file_control * fcp;
+{
+struct in_rec in_rec;
+FILE * fp;
+
+    if (fcp->content.data.col_defs != NULL)
+        return 1;
+    if (!strcmp(fcp->fname, "-") || (fp = fopen(fcp->fname, "rb")) == NULL)
+        return 0;
+    memset((unsigned char *) &in_rec, 0, sizeof(struct in_rec));
+    if (get_next(&in_rec, fp) != NULL)
+        fcp->content.data.col_defs = new_row(&in_rec);
+    if (in_rec.fptr[0] != NULL)
+        free(in_rec.fptr[0]);
+    fclose(fp);
+    return (fcp->content.data.col_defs != NULL);
+}
 /*
  * Read data in to memory
  * -    Open the file
@@ -499,7 +764,9 @@ struct in_rec in_rec;
 struct in_rec * cur_rec;
 int old_alloc;
 int i;
+FCT_DECL(t0)
 
+    FCT_START(t0);
     if (!strcmp(fcp->fname, "-"))
         fcp->fp = stdin;
     else
@@ -520,8 +787,10 @@ int i;
             return 0;
         }
         fcp->content.data.col_defs = new_row(&in_rec);
+        free(in_rec.fptr[0]);
     }
     get_rows(fcp->fp, &(fcp->content.data));
+    FCT_SPAN("get_data", fcp->fname, fcp->content.data.recs, t0);
     return 1;
 }
 struct file_control * new_data_file_control(fname, prev_fcp)
@@ -540,6 +809,638 @@ struct file_control * fcp = (struct file_control *) calloc(1, sizeof(*fcp));
     get_data(fcp);
     return fcp;
 }
+/*
+ * Allocate the arrays for an index of up to alloc rows
+ */
+static void grow_row_index(ip, alloc)
+struct row_index * ip;
+int alloc;
+{
+    ip->alloc = alloc;
+    ip->rowp = (unsigned char **) realloc(ip->rowp,
+                               sizeof(unsigned char *) * alloc);
+    ip->rowlen = (unsigned int *) realloc(ip->rowlen,
+                               sizeof(unsigned int) * alloc);
+    ip->colb = (unsigned char **) realloc(ip->colb,
+                               sizeof(unsigned char *) * alloc);
+    ip->colo = (unsigned int *) realloc(ip->colo,
+                               sizeof(unsigned int) * alloc * (ip->cols + 1));
+    return;
+}
+static struct row_index * new_row_index(cols, alloc)
+int cols;
+int alloc;
+{
+struct row_index * ip = (struct row_index *) calloc(1, sizeof(*ip));
+
+    ip->cols = cols;
+    grow_row_index(ip, (alloc < 1) ? 1 : alloc);
+    return ip;
+}
+/*
+ * Add a row with escapes in it to an index. It goes through rec_anal(), so
+ * that the escapes are dealt with exactly as they would be otherwise, and the
+ * columns are copied out to the index's arena, separated by NULs. Returns 0 if
+ * the row is skipped for having too few columns.
+ */
+static int index_escaped_row(ip, r, ls, len, in_rec)
+struct row_index * ip;
+int r;
+unsigned char * ls;
+int len;
+struct in_rec * in_rec;
+{
+unsigned int * op = &ip->colo[r * (ip->cols + 1)];
+unsigned char * xp;
+int tot;
+int j;
+
+    if (len > sizeof(in_rec->buf) - 2)
+        len = sizeof(in_rec->buf) - 2;
+    memcpy(in_rec->buf, ls, len);
+    in_rec->buf[len] = '\0';
+    rec_anal(in_rec);
+    free(in_rec->fptr[0]);
+    in_rec->fptr[0] = NULL;
+    if (in_rec->fcnt < ip->cols)
+        return 0;
+    for (j = 1, tot = 0; j <= ip->cols; j++)
+        tot += strlen(in_rec->fptr[j]) + 1;
+    if ((xp = (unsigned char *) arena_alloc(&ip->arena, tot)) == NULL)
+        return 0;
+    ip->colb[r] = xp;
+    for (j = 1, tot = 0; j <= ip->cols; j++)
+    {
+        *op++ = tot;
+        len = strlen(in_rec->fptr[j]) + 1;
+        memcpy(xp + tot, in_rec->fptr[j], len);
+        tot += len;
+    }
+    *op = tot;
+    return 1;
+}
+/*
+ * Add the line from ls up to its line feed at le to an index as row r; the
+ * seps array must have room for a separator per column. Returns 0 if the row
+ * is skipped for having too few columns, as get_rows() does.
+ */
+static int index_line(ip, r, ls, le, seps, in_rec)
+struct row_index * ip;
+int r;
+unsigned char * ls;
+unsigned char * le;
+unsigned int * seps;
+struct in_rec * in_rec;
+{
+unsigned int * op;
+char * fs = get_fs();
+int single = (fs[1] == '\0');
+int esc;
+int n;
+int j;
+
+    ip->rowp[r] = ls;
+    ip->rowlen[r] = le - ls + 1;
+    n = find_seps(ls, le - ls, fs, seps, ip->cols, (single) ? &esc : NULL);
+    if (single && esc)
+        return index_escaped_row(ip, r, ls, le - ls + 1, in_rec);
+    if (n < ip->cols - 1)
+        return 0;                 /* Too few columns */
+    ip->colb[r] = ls;
+    op = &ip->colo[r * (ip->cols + 1)];
+    for (j = 0; j < ip->cols; j++)
+        *op++ = (j == 0) ? 0 : (seps[j - 1] + 1);
+    if (n >= ip->cols)
+        j = seps[ip->cols - 1];
+    else
+    {
+/*
+ * The last field loses its line terminator
+ */
+        for (j = le - ls; j > *(op - 1) && ls[j - 1] == '\r'; j--);
+    }
+    *op = j + 1;
+    return 1;
+}
+/*
+ * Decide where to start taking rows, and where to go round to, given where the
+ * first row after the heading is (-1 if the file cannot be positioned) and the
+ * size of the file (-1 if not known). Offsets in the heading or beyond the end
+ * of the file are ignored, as is going round to somewhere after the start.
+ */
+static void place_rows(ip, rtp, first_off, size)
+struct row_index * ip;
+struct row_track * rtp;
+long long first_off;
+long long size;
+{
+    ip->first_off = first_off;
+    ip->first_line = 1;
+    ip->start_off = first_off;
+    ip->start_line = 1;
+    if (first_off >= 0 && rtp->start_off > first_off
+     && (size < 0 || rtp->start_off <= size))
+    {
+        ip->start_off = rtp->start_off;
+        ip->start_line = rtp->start_line;
+        if (rtp->ring_off > first_off && rtp->ring_off <= rtp->start_off)
+        {
+            ip->first_off = rtp->ring_off;
+            ip->first_line = rtp->ring_line;
+        }
+    }
+    ip->rest_line = ip->start_line;
+    return;
+}
+/*
+ * Read a data file that can't be mapped, and index the rows wanted. Each line
+ * is copied once, to the index's arena, and the columns are found in the copy
+ * just as they are in a mapping. A last line without a line terminator is put
+ * back for the rest of the file, if the file can be positioned.
+ */
+static int stream_data(fcp)
+struct file_control * fcp;
+{
+struct row_track * rtp = &(fcp->content.data);
+struct row_index * ip;
+struct in_rec in_rec;
+unsigned char * lp;
+unsigned int * seps;
+char * line;
+int lalloc = 65536;
+int alloc;
+int len;
+int r;
+long pos;
+
+    if (!strcmp(fcp->fname, "-"))
+        fcp->fp = stdin;
+    else
+    if ((fcp->fp = fopen(fcp->fname, "rb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open data file %s\n", fcp->fname);
+        perror("fopen()");
+        rtp->recs = 0;
+        return 0;
+    }
+/*
+ * The heading is always read past, even if it has been read already
+ */
+    memset((unsigned char *) &in_rec, 0, sizeof(struct in_rec));
+    if (get_next(&in_rec, fcp->fp) == NULL
+     || (rtp->col_defs == NULL && (rtp->col_defs = new_row(&in_rec)) == NULL))
+    {
+        fprintf(stderr, "No header line in %s\n", fcp->fname);
+        rtp->recs = 0;
+        return 0;
+    }
+    alloc = (rtp->recs > 0) ? rtp->recs : 128;
+    ip = new_row_index(rtp->col_defs->cols, alloc);
+    seps = (unsigned int *) malloc(sizeof(unsigned int) * (ip->cols + 1));
+    line = (char *) malloc(lalloc);
+    pos = ftell(fcp->fp);
+    place_rows(ip, rtp, (long long) pos, -1LL);
+    if (ip->start_off != pos && fseek(fcp->fp, ip->start_off, SEEK_SET) != 0)
+        place_rows(ip, rtp, (long long) pos, 0LL);
+    for (r = 0; rtp->recs <= 0 || r < rtp->recs;)
+    {
+        pos = ftell(fcp->fp);
+        if (ip->end_line != 0 && pos >= ip->start_off)
+            break;                          /* Back where we started */
+        for (len = 0;
+                fgets(line + len, lalloc - len, fcp->fp) != NULL;)
+        {
+            len += strlen(line + len);
+            if (line[len - 1] == '\n')
+                break;
+            lalloc += lalloc;
+            line = (char *) realloc(line, lalloc);
+        }
+        if (len == 0 || line[len - 1] != '\n')
+        {
+            if (len > 0 && pos >= 0)
+                fseek(fcp->fp, pos, SEEK_SET);
+/*
+ * Go round if we are allowed to, and have not already
+ */
+            if (!rtp->wrap || ip->end_line != 0 || pos < 0
+              || ip->start_off <= ip->first_off
+              || fseek(fcp->fp, ip->first_off, SEEK_SET) != 0)
+                break;
+            ip->end_off = pos;
+            ip->end_line = ip->rest_line;
+            ip->rest_line = ip->first_line;
+            continue;
+        }
+        if (r >= alloc)
+        {
+            alloc += alloc;
+            grow_row_index(ip, alloc);
+        }
+        if ((lp = (unsigned char *) arena_alloc(&ip->arena, len)) == NULL)
+        {
+            fputs("Not enough memory ...\n", stderr);
+            break;
+        }
+        memcpy(lp, line, len);
+        if (index_line(ip, r, lp, lp + len - 1, seps, &in_rec))
+            r++;
+        ip->rest_line++;
+    }
+    ip->rest_off = ftell(fcp->fp);
+    if (in_rec.fptr[0] != NULL)
+        free(in_rec.fptr[0]);
+    free(line);
+    free(seps);
+    ip->recs = r;
+    rtp->recs = r;
+    rtp->index = ip;
+    return 1;
+}
+#ifdef LINUX
+/*
+ * Index the rows in a stretch of a mapping, until there are want rows in the
+ * index (no limit if want is not positive). Returns where it stopped; at the
+ * limit, at a last line without a line terminator, or at the first row not
+ * wanted.
+ */
+static unsigned char * map_rows(ip, want, ls, limit, seps, in_rec)
+struct row_index * ip;
+int want;
+unsigned char * ls;
+unsigned char * limit;
+unsigned int * seps;
+struct in_rec * in_rec;
+{
+unsigned char * le;
+
+    for (; ls < limit && (want <= 0 || ip->recs < want); ls = le + 1)
+    {
+        if ((le = memchr(ls, '\n', limit - ls)) == NULL)
+            break;
+        if (ip->recs >= ip->alloc)
+            grow_row_index(ip, ip->alloc + ip->alloc);
+        if (index_line(ip, ip->recs, ls, le, seps, in_rec))
+            ip->recs++;
+        ip->rest_line++;
+    }
+    return ls;
+}
+/*
+ * Add up to want more rows from a mapping to its index (all there are if want
+ * is not positive), carrying on from where the last ones ended, and going
+ * round if we are allowed to, but not past where we began.
+ */
+static void map_more(ip, rtp, want)
+struct row_index * ip;
+struct row_track * rtp;
+int want;
+{
+struct in_rec in_rec;
+unsigned int * seps;
+unsigned char * ls;
+
+    memset((unsigned char *) &in_rec, 0, sizeof(struct in_rec));
+    seps = (unsigned int *) malloc(sizeof(unsigned int) * (ip->cols + 1));
+    if (want > 0)
+        want += ip->recs;
+    ls = ip->base + ip->rest_off;
+    if (ip->end_line == 0)
+    {
+        ls = map_rows(ip, want, ls, ip->base + ip->size, seps, &in_rec);
+        if (rtp->wrap && ip->start_off > ip->first_off
+         && (want <= 0 || ip->recs < want))
+        {
+            ip->end_off = ls - ip->base;
+            ip->end_line = ip->rest_line;
+            ip->rest_line = ip->first_line;
+            ls = ip->base + ip->first_off;
+        }
+    }
+    if (ip->end_line != 0)
+        ls = map_rows(ip, want, ls, ip->base + ip->start_off, seps, &in_rec);
+    ip->rest_off = ls - ip->base;
+    free(seps);
+    if (in_rec.fptr[0] != NULL)
+        free(in_rec.fptr[0]);
+    return;
+}
+/*
+ * Map a data file and index the rows wanted, unless more is not set, when the
+ * rows are left for get_data_window(). The header is analysed and copied as
+ * usual. Rows with too few columns are skipped, as get_rows() does. A last
+ * line without a line terminator is left for the rest of the file.
+ *
+ * Returns 0 if the file cannot be mapped, without saying anything; the caller
+ * will fall back to reading it.
+ */
+static int map_data(fcp, more)
+struct file_control * fcp;
+int more;
+{
+struct row_track * rtp = &(fcp->content.data);
+struct row_index * ip;
+struct in_rec in_rec;
+struct stat st;
+unsigned char * base;
+unsigned char * le;
+int fd;
+int j;
+
+    if (!strcmp(fcp->fname, "-") || (fd = open(fcp->fname, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < 1
+     || (base = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                  fd, 0)) == (unsigned char *) MAP_FAILED)
+    {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    memset((unsigned char *) &in_rec, 0, sizeof(struct in_rec));
+/*
+ * The heading
+ */
+    if ((le = memchr(base, '\n', st.st_size)) == NULL)
+    {
+        fprintf(stderr, "No header line in %s\n", fcp->fname);
+        munmap(base, st.st_size);
+        rtp->recs = 0;
+        return -1;
+    }
+    if (rtp->col_defs == NULL)
+    {
+        j = le - base + 1;
+        if (j > sizeof(in_rec.buf) - 2)
+            j = sizeof(in_rec.buf) - 2;
+        memcpy(in_rec.buf, base, j);
+        in_rec.buf[j] = '\0';
+        rec_anal(&in_rec);
+        rtp->col_defs = new_row(&in_rec);
+        free(in_rec.fptr[0]);
+        in_rec.fptr[0] = NULL;
+        if (rtp->col_defs == NULL)
+        {
+            munmap(base, st.st_size);
+            rtp->recs = 0;
+            return -1;
+        }
+    }
+    ip = new_row_index(rtp->col_defs->cols,
+                   (more && rtp->recs > 0) ? rtp->recs : 128);
+    ip->base = base;
+    ip->size = st.st_size;
+/*
+ * Now the rows, from where the caller wants to start
+ */
+    place_rows(ip, rtp, (long long) (le + 1 - base), ip->size);
+    ip->rest_off = ip->start_off;
+    rtp->index = ip;
+    if (more)
+    {
+        map_more(ip, rtp, rtp->recs);
+        rtp->recs = ip->recs;
+    }
+    return 1;
+}
+#endif
+/*
+ * Index the next window of rows from a data file, giving back the last, so
+ * that a very large number of rows can be worked through a window at a time.
+ * The first call maps the file, and indexes want rows; none if want is 0, or
+ * all there are if want is negative. row0 in the index then says which of the
+ * rows taken is the first in the window.
+ *
+ * Only a file that can be mapped can be windowed; 0 is returned, and nothing
+ * is done, if this one cannot be.
+ */
+int get_data_window(fcp, want)
+struct file_control * fcp;
+int want;
+{
+#ifdef LINUX
+struct row_index * ip;
+long long lo;
+long long hi;
+long page;
+FCT_DECL(t0)
+
+    FCT_START(t0);
+    if ((ip = fcp->content.data.index) == NULL)
+    {
+        if (map_data(fcp, 0) <= 0)
+            return 0;
+        ip = fcp->content.data.index;
+    }
+    else
+    if (ip->base == NULL)
+        return 0;
+    else
+    {
+/*
+ * The pages the last window was in need not count against us any more
+ */
+        if (ip->recs > 0)
+        {
+            page = sysconf(_SC_PAGESIZE);
+            lo = ((ip->rowp[0] - ip->base) + page - 1) / page * page;
+            hi = ip->rest_off / page * page;
+            if (hi > lo)
+                madvise(ip->base + lo, hi - lo, MADV_DONTNEED);
+        }
+        ip->row0 += ip->recs;
+        ip->recs = 0;
+        zap_arena(ip->arena);
+        ip->arena = NULL;
+    }
+    if (want != 0)
+        map_more(ip, &fcp->content.data, want);
+    FCT_SPAN("get_data_window", fcp->fname, ip->recs, t0);
+    return 1;
+#else
+    return 0;
+#endif
+}
+/*
+ * Count the lines ahead of where a windowed file has got to, going round if
+ * allowed, stopping once max have been found. These are the most rows that
+ * get_data_window() can still give.
+ */
+long long data_lines_ahead(fcp, max)
+struct file_control * fcp;
+long long max;
+{
+long long n = 0;
+#ifdef LINUX
+struct row_index * ip = fcp->content.data.index;
+unsigned char * xp;
+unsigned char * limit;
+
+    if (ip == NULL || ip->base == NULL)
+        return 0;
+    for (xp = ip->base + ip->rest_off,
+         limit = ip->base + ((ip->end_line == 0) ? ip->size : ip->start_off);
+            n < max && xp < limit
+         && (xp = memchr(xp, '\n', limit - xp)) != NULL;
+                xp++)
+        n++;
+    if (n < max && ip->end_line == 0 && fcp->content.data.wrap
+     && ip->start_off > ip->first_off)
+        for (xp = ip->base + ip->first_off, limit = ip->base + ip->start_off;
+                n < max && xp < limit
+             && (xp = memchr(xp, '\n', limit - xp)) != NULL;
+                    xp++)
+            n++;
+#endif
+    return n;
+}
+/*
+ * Read data in to memory, by mapping it if possible, and index it. Once this
+ * has been done, the rows must be reached through the index; there is no rows
+ * array.
+ *
+ * The rows are taken from start_off in the row_track, if it is set and is
+ * after the heading; otherwise from the first row. If wrap is set, rows are
+ * then taken from ring_off (or the first row), up to where we started, as
+ * needed.
+ */
+int get_data_index(fcp)
+struct file_control * fcp;
+{
+int ret;
+FCT_DECL(t0)
+
+    FCT_START(t0);
+#ifdef LINUX
+    if ((ret = map_data(fcp, 1)) != 0)
+        ret = (ret > 0);
+    else
+#endif
+        ret = stream_data(fcp);
+    FCT_SPAN("get_data_index", fcp->fname, fcp->content.data.recs, t0);
+    return ret;
+}
+void zap_row_index(ip)
+struct row_index * ip;
+{
+#ifdef LINUX
+    if (ip->base != NULL)
+        munmap(ip->base, ip->size);
+#endif
+    zap_arena(ip->arena);
+    free(ip->rowp);
+    free(ip->rowlen);
+    free(ip->colb);
+    free(ip->colo);
+    free(ip);
+    return;
+}
+/*
+ * Record the start of a line, and whether it begins with the marker
+ */
+static void add_line(lip, base, off, len, marker)
+struct line_index * lip;
+unsigned char * base;
+unsigned long off;
+unsigned long len;
+char * marker;
+{
+    if (lip->nlines + 1 >= lip->alloc)
+    {
+        lip->alloc += lip->alloc;
+        lip->start = (unsigned long *) realloc(lip->start,
+                                  sizeof(unsigned long) * lip->alloc);
+    }
+    lip->start[lip->nlines++] = off;
+    if (marker != NULL && off + 1 < len && base[off] == marker[0]
+      && base[off + 1] == marker[1])
+    {
+        if (lip->nmarked >= lip->mark_alloc)
+        {
+            lip->mark_alloc = (lip->mark_alloc < 64) ? 64 : (lip->mark_alloc + lip->mark_alloc);
+            lip->marked = (int *) realloc(lip->marked,
+                                  sizeof(int) * lip->mark_alloc);
+        }
+        lip->marked[lip->nmarked++] = lip->nlines;
+    }
+    return;
+}
+/*
+ * Find where all the lines in some text start, in a single pass. Line n
+ * (counting from 1) runs from start[n - 1] up to start[n] - 1, which is its
+ * line feed unless it is the last line and that has none. Lines starting with
+ * the two characters of the marker (if any) are listed as well, so they can be
+ * found without going through all the lines again.
+ *
+ * Where the compiler will let us, the line feeds are looked for 32 or 16 bytes
+ * at a time.
+ */
+struct line_index * index_lines(base, len, marker)
+unsigned char * base;
+unsigned long len;
+char * marker;
+{
+struct line_index * lip;
+unsigned long i = 0;
+unsigned char * xp;
+#ifdef LINE_SIMD
+unsigned int mask;
+#endif
+
+    lip = (struct line_index *) calloc(1, sizeof(struct line_index));
+    lip->alloc = (int) (len / 32) + 16;
+    lip->start = (unsigned long *) malloc(sizeof(unsigned long) * lip->alloc);
+    if (len > 0)
+        add_line(lip, base, 0, len, marker);
+#ifdef LINE_SIMD
+#ifdef __AVX2__
+    {
+    __m256i nl = _mm256_set1_epi8('\n');
+
+        for (; i + 32 <= len; i += 32)
+        {
+            mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((__m256i *) (base + i)), nl));
+            for (; mask != 0; mask &= mask - 1)
+                if (i + __builtin_ctz(mask) + 1 < len)
+                    add_line(lip, base, i + __builtin_ctz(mask) + 1, len,
+                               marker);
+        }
+    }
+#endif
+    {
+    __m128i nl = _mm_set1_epi8('\n');
+
+        for (; i + 16 <= len; i += 16)
+        {
+            mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((__m128i *) (base + i)), nl));
+            for (; mask != 0; mask &= mask - 1)
+                if (i + __builtin_ctz(mask) + 1 < len)
+                    add_line(lip, base, i + __builtin_ctz(mask) + 1, len,
+                               marker);
+        }
+    }
+#endif
+/*
+ * Whatever is left over
+ */
+    for (; i < len && (xp = memchr(base + i, '\n', len - i)) != NULL;
+               i = (xp - base) + 1)
+        if ((xp - base) + 1 < len)
+            add_line(lip, base, (xp - base) + 1, len, marker);
+    lip->start[lip->nlines] = len;
+    return lip;
+}
+void zap_line_index(lip)
+struct line_index * lip;
+{
+    free(lip->start);
+    if (lip->marked != NULL)
+        free(lip->marked);
+    free(lip);
+    return;
+}
 void zap_data_file_control(fcp, prev_fcp)
 struct file_control * fcp;
 struct file_control * prev_fcp;
@@ -554,10 +1455,15 @@ int i;
         free(fcp->content.data.col_defs);
     if (fcp->content.data.rows != NULL)
     {
+        if (fcp->content.data.arena != NULL)
+            zap_arena(fcp->content.data.arena);
+        else
         for (i = 0; i < fcp->content.data.recs; i++)
             free(fcp->content.data.rows[i]);
         free(fcp->content.data.rows);
     }
+    if (fcp->content.data.index != NULL)
+        zap_row_index(fcp->content.data.index);
     if (fcp->fp != NULL)
         fclose(fcp->fp);
     free(fcp);
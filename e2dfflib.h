@@ -31,6 +31,61 @@ struct row {
    int cols;
    unsigned char ** colp;
 };
+/*
+ * A read-only index of rows. Each row has where its text starts and how long
+ * it is, and cols + 1 offsets giving where each column starts relative to a
+ * column base; the value of column i runs up to one short of offset i + 1.
+ *
+ * When the file is mapped, nothing is copied; the rows and columns are found
+ * in the mapping. Otherwise each row is read in once, and they are found in
+ * that. Rows with escapes in them are the exception; they are put through
+ * rec_anal() as usual and the column base is the copy.
+ *
+ * The rows need not start with the first after the heading; the row_track
+ * says where to begin, and whether and where to go round to when the end of
+ * the file is reached. The offsets and line numbers say what was taken.
+ *
+ * A mapped file can instead be worked through a window at a time, with
+ * get_data_window(); row0 is then the number of rows taken before the window.
+ */
+struct row_arena;
+struct row_index {
+    unsigned char * base;       /* The mapping, if there is one             */
+    struct row_arena * arena;   /* Row text read in, and rows with escapes  */
+    long long size;             /* Size of the mapping                      */
+    long long first_off;        /* Where we go round to at the end          */
+    long long start_off;        /* Where the rows taken begin               */
+    long long rest_off;         /* Where the rows not taken begin           */
+    long long end_off;          /* Where the rows ended, if we went round   */
+    long long first_line;       /* Line numbers at each of the offsets,     */
+    long long start_line;       /* counting from 1 after the heading; end   */
+    long long rest_line;        /* is 0 if we did not go round              */
+    long long end_line;
+    int recs;                   /* Rows indexed                             */
+    int alloc;                  /* Rows there is room for                   */
+    int row0;                   /* Rows taken before these, if windowed     */
+    int cols;                   /* Columns indexed in each row              */
+    unsigned char ** rowp;      /* Where each row's text begins             */
+    unsigned int * rowlen;      /* Length of each row, with line terminator */
+    unsigned char ** colb;      /* Base for each row's column offsets       */
+    unsigned int * colo;        /* cols + 1 column offsets for each row     */
+};
+#define IDX_COL(ip, r, i)\
+        ((ip)->colb[(r)] + (ip)->colo[(r) * ((ip)->cols + 1) + (i)])
+#define IDX_COL_LEN(ip, r, i)\
+        ((ip)->colo[(r) * ((ip)->cols + 1) + (i) + 1] -\
+         (ip)->colo[(r) * ((ip)->cols + 1) + (i)] - 1)
+/*
+ * Where the lines in a block of text start; see index_lines().
+ */
+struct line_index {
+    int nlines;
+    int alloc;
+    unsigned long * start;      /* nlines + 1; the last is the text length  */
+    int nmarked;
+    int mark_alloc;
+    int * marked;               /* Lines (from 1) that start with a marker  */
+};
 /*
  * The header for a collection of rows from a single file.
  */
@@ -40,22 +95,34 @@ struct row_track {
     int alloc;
     int cur_row;
     struct row ** rows;
+    struct row_index * index;   /* Rows mapped or indexed by get_data_index() */
+    long long start_off;        /* Where get_data_index() starts taking rows */
+    long long start_line;       /* The line number there                     */
+    long long ring_off;         /* Where to go round to at the end, and its  */
+    long long ring_line;        /* line number; 0 for the first row          */
+    int wrap;                   /* Whether to go round at all                */
+    struct row_arena * arena;   /* Where get_rows() put the rows            */
 };
 /*
- * Struct used for tracking things to be written out. We put the function
- * to call and two arguments in the structure.
+ * Struct used for tracking things to be written out; either a span of the
+ * script, or a substitution from a data file.
  */
+#define PIECE_TEXT 0
+#define PIECE_SUB  1
 struct piece {
     unsigned long len;         /* Holds col for data piece     */
-    char * p;                  /* Holds def line operand for data piece */
-    void (*write_fun)();       /* Function for writing   */ 
+    char * p;                  /* Text, or the text a data piece replaces */
+    int kind;                  /* PIECE_TEXT or PIECE_SUB */
+    int fresh;                 /* Whether a data piece takes a fresh row */
     struct file_control * fcp; /* Used with data file    */
+    unsigned long match_len;   /* Length of the text a data piece replaces */
     struct piece * next_piece;
 };
 struct file_control {
     char * fname;
     unsigned int flen;
     FILE * fp;
+    int slot;                  /* Index of a data file in per-user cursors */
     struct file_control * next_file;
     union {
        struct piece * piece_anchor;
@@ -69,6 +136,7 @@ struct file_control {
  */
 struct in_rec {
    int fcnt;
+   int lalloc;                 /* Size of the line copy in fptr[0] */
    char * fptr[1024];
    char buf[65536];
 };
@@ -79,6 +147,15 @@ void get_rows();
 void sort_rows();
 struct row * col_defs();
 int get_data();
+int get_data_heading();
+int get_data_index();
+int get_data_window();
+long long data_lines_ahead();
+void zap_row_index();
+void * arena_alloc();
+void zap_arena();
+struct line_index * index_lines();
+void zap_line_index();
 int * get_sizes();
 int col_ind();
 void set_fs();
@@ -93,7 +170,9 @@ char * where_fragment();
 char * dynamic_where();
 char * create_delete_SQL();
 char * create_update_SQL();
+char * create_custom_update_SQL();
 char * create_insert_SQL();
 char * quoterow();
+struct file_control * new_data_file_control();
 void zap_data_file_control();
 #endif
@@ -13,6 +13,29 @@
  * 8 - Whether or not data values can be re-used
  * Options:
  * -c  Simply output the numbers of records required from each file.
+ * -j  Number of threads to write the users' scripts with (default 1).
+ * -W  Write the scripts with writev() from large buffers rather than stdio.
+ * -v  Report on what was done, and how quickly.
+ * -n  Ignore any plan cached by an earlier run, and do not save one.
+ * -C  Consume the data through a cursor kept next to each data file, rather
+ *     than by re-writing the data files.
+ * -s  Clone all the bundles in a scenario manifest (SCRIPT|BUNDLE|USERS|
+ *     TRANSACTIONS|THINK_TIME); the parameters are then just 2, 6 and 8.
+ * -S  Serve clone requests on a Unix domain socket, rather than doing one
+ *     clone; there are then no parameters. See serve() for the protocol.
+ * -M  Memory (bytes, or with a K, M or G suffix) the data file indexes may
+ *     take. Files that would take more are worked through in windows.
+ * -A  Write all the users' scripts for a bundle to a single archive,
+ *     echo<pid>.<bundle>.fca, rather than a file for each; see fcarch.h.
+ * -P  Number of writer threads to hand the scripts over to, so that the
+ *     threads rendering them never wait on the disk; see fcpipe.h.
+ * -Q  Writes each writer thread may have in flight at once (default 8);
+ *     with 1, the writers use pwrite() rather than io_uring.
+ * -J  Write the time each phase took, and how much was read, parsed and
+ *     written, to this file as a JSON document ("-" for stdout).
+ * -H  Count cycles, instructions, last level cache misses and branch misses
+ *     in each phase with the hardware counters (Linux only), and report them
+ *     on stderr, and with -J.
  ***********************************************************************
  * The original scripts streamed each file in turn through a multiple-sed
  * pipeline. The approach uses very little memory, but masses of CPU.
@@ -37,19 +60,37 @@
  * -    Works a bundle at a time
  * -    Reads the entire script file in to memory
  * -    Reads the def file, if there is one
- * -    Works out how many records are needed from each data file,
- *      and pre-reads them.
  * -    Constructs a write control structure, listing the file fragments and
- *      lengths, and where replacement values come from.
+ *      lengths, and where replacement values come from. The structure is
+ *      cached next to the script, and re-used until the script, the def file
+ *      or the data file headings change.
+ * -    Works out from it how many records are needed from each data file,
+ *      and maps (or pre-reads) and indexes them.
+ * -    Flattens the structure in to a plan with the data file columns already
+ *      resolved.
  * -    Writes all the scripts
  * -    Writes out spent data
  * -    If data values can be re-used, appends the used values to the back of
  *      the original file.
+ * If variable length substitutions are not allowed, each value is cut short
+ * or padded out with spaces to the length of the text it replaces. Then every
+ * script is the same, known, size, so on Linux each is written straight in to
+ * a file mapped at that size (or in to the archive with -A, or the pipeline
+ * with -P) rather than with stdio or writev().
+ * With -C, the data files are left alone. A cursor file records where the
+ * next run should start taking rows, the spent file records the ranges that
+ * were taken, and re-use just means going round to the first row at the end.
+ * The rows are claimed under a lock, so several fastclone processes can take
+ * rows from the same data files, and write their scripts, at the same time.
  ***********************************************************************
  * Actually, we can do even better than this. If we do the whole scenario at
  * once, we can count up the records needed for all the scripts, and extract
  * them all in one go. But then we might struggle if we have to do thousands
  * of scripts.
+ *
+ * The -s option does just that. The bundles in the manifest share the data
+ * files; each file is read once, each bundle gets its own range of the rows,
+ * and the data files are tidied once at the end.
  */
 static char * sccs_id =  "@(#) $Name$ $Id$\n\
 Copyright (c) E2 Systems Limited 1993\n";
@@ -64,8 +105,31 @@ Copyright (c) E2 Systems Limited 1993\n";
 #include <ctype.h>
 #include <errno.h>
 #include "e2conv.h"
-#include "bmmatch.h"
+#include "hashlib.h"
+#include "acmatch.h"
 #include "e2dfflib.h"
+#include "fcarch.h"
+#include "fctrace.h"
+#ifdef LINUX
+#include "fcpipe.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
 static char * path_home;
 static char * path_ext;
 /*
@@ -80,6 +144,128 @@ char * strdup();
 #endif
 extern int optind;
 extern char * optarg;
+/*
+ * The flattened form of the piece chain that the clone is driven from. Each
+ * step either writes out a span of fixed text (script or think time), or
+ * writes a column from the current row of a data file.
+ */
+#define PLAN_SPAN  0
+#define PLAN_THINK 1
+#define PLAN_COL   2
+struct plan_op {
+    int op;                    /* PLAN_SPAN, PLAN_THINK or PLAN_COL         */
+    int fresh;                 /* Column from a fresh row ('F' disposition) */
+    int slot;                  /* Data file slot for a column               */
+    int col;                   /* Column index, or -1 if it is not known    */
+    char * p;                  /* Start of a span                           */
+    unsigned long len;         /* Length of a span, or of what a column     */
+};                             /* replaces                                  */
+/*
+ * What the plan needs to know about each data file
+ */
+struct plan_src {
+    struct row_index * index;
+    int first;                 /* The rows this bundle may use               */
+    int recs;
+    int row0;                  /* The row at the start of the index          */
+};
+struct clone_plan {
+    int nops;
+    struct plan_op * ops;
+    int nsrcs;
+    struct plan_src * srcs;    /* Indexed by data file slot                 */
+    int * cons;                /* Rows a transaction takes from each file   */
+};
+/*
+ * Where the time goes, and how much is done, over all the bundles; reported
+ * with -v, and written out as JSON with -J.
+ */
+#define PH_SCRIPT   0
+#define PH_DEF      1
+#define PH_DATA     2
+#define PH_ASSEMBLE 3
+#define PH_CLONE    4
+#define PH_TIDY     5
+#define PH_COUNT    6
+#ifndef FC_BENCH
+static char * phase_names[PH_COUNT] = {"script", "def", "data", "assemble",
+                                       "clone", "tidy"};
+#endif
+/*
+ * The hardware counters read around the phases with -H
+ */
+#define HW_CYCLES        0
+#define HW_INSTRUCTIONS  1
+#define HW_LLC_MISSES    2
+#define HW_BRANCH_MISSES 3
+#define HW_COUNT         4
+#ifndef FC_BENCH
+static char * hw_names[HW_COUNT] = {"cycles", "instructions", "llc_misses",
+                                    "branch_misses"};
+#endif
+struct run_stats {
+   double started;
+   double secs[PH_COUNT];      /* Elapsed time in each phase                */
+   int bundles;
+   long long users;
+   long long bytes_read;       /* Script, def and data file text taken in   */
+   long long bytes_written;    /* Scripts, and the data files re-written    */
+   long long rows_parsed;      /* Def file and data file rows               */
+   long long subs;             /* Data values written in to the scripts     */
+   long long pieces;           /* Steps in the bundles' plans               */
+   long long rejected;         /* Def file matches overtaken by others      */
+   int hw_on;                  /* Whether the hardware counters are open    */
+   int hw_fd[HW_COUNT];        /* -1 for a counter the machine doesn't have */
+   long long hw_last[HW_COUNT];
+   long long hw[PH_COUNT][HW_COUNT];
+};
+/*
+ * The things that all the bundles being cloned have in common; the options,
+ * and the data files, which the bundles share out between them.
+ */
+struct scenario {
+   struct file_control * data_anchor;
+   int data_cnt;               /* Number of data files (slots) on the chain */
+   HASH_CON * data_names;      /* The data files on the chain, by name      */
+   HASH_CON ** col_names;      /* Column headings, by data file slot        */
+   int ncol_names;
+   char * pid;                 /* The run id                                */
+   int var_flag;               /* Whether length changes are allowed or not */
+   int reuse_flag;             /* Whether data values can be re-used        */
+   int count_flag;             /* Only counting the records needed          */
+   int nthreads;               /* Number of threads writing scripts         */
+   int out_mode;               /* OUT_STDIO or OUT_WRITEV                   */
+   int verbose;                /* Whether to report on progress             */
+   int no_cache;               /* Whether to ignore the plan cache          */
+   int cursor_flag;            /* Whether to consume data through cursors   */
+   int * locks;                /* Lock file descriptors, by data file slot  */
+   long long max_mem;          /* Memory the data file indexes may take     */
+   long long window_mem;       /* What is left of it for the windows        */
+   char * windowed;            /* Whether in windows, by data file slot     */
+   int archive_flag;           /* Whether to write the scripts to archives  */
+   int pipe_writers;           /* Writer threads in the pipeline, if any    */
+   int pipe_depth;             /* Writes each may have in flight            */
+   char * stats_fname;         /* Where to write the statistics as JSON     */
+   int write_errors;           /* Pipeline writes that failed; if any, the  */
+                               /* run fails                                 */
+   struct run_stats stats;
+};
+/*
+ * What the plan cache depends on in a file
+ */
+struct file_stamp {
+   long long size;
+   long long mtime;
+   unsigned long long hash;
+};
+/*
+ * What one bundle takes from one data file
+ */
+struct data_share {
+   int per_trans;              /* Rows a transaction needs; 0 if not used   */
+   int first;                  /* First row given to the bundle             */
+   int recs;                   /* Rows given to the bundle                  */
+};
 /*
  * Structure that controls the writing out process
  */
@@ -90,107 +276,362 @@ struct write_control {
  * as different locations are identified
  */
    struct file_control script_file;
+   char * script_base;         /* The script text, which the pieces point in */
+   unsigned long script_len;
+   int script_mapped;          /* Whether script_base is an mmap()          */
 /*
  * Where the def file is co-ordinated from
  */
    struct file_control def_file;
 /*
- * Keeps track of each data file.
+ * Keeps track of each data file; the files themselves belong to the scenario,
+ * and the shares are indexed by their slots.
  */
-   struct file_control * data_anchor;
+   struct scenario * scp;
+   struct data_share * shares;
+   int nshares;
+   char * bundle;
+   int nusers;
+   int ntrans;
    int var_flag;               /* Whether length changes are allowed or not */
+   char think_time_buf[16];    /* The think time directive to substitute    */
+   struct ac_table * matcher;  /* All the def file MATCH strings            */
+   int * def_word;             /* The matcher word for each def file row    */
+   int * def_line;             /* The LINE_NO of each def file row          */
+   int * def_col;              /* The column each def file row takes        */
+   int nwild;                  /* Def file rows that apply to any line      */
+   int * wild;
+   int * wild_hits;
+   struct ac_hit * hits;       /* Where the words were found on a line      */
+   int hit_alloc;
+   struct clone_plan * plan;   /* What do_the_clone() actually works from   */
+   int user_errors;            /* Def file problems found when assembling   */
+   int scanned;                /* Whether the script has been gone through  */
+   char * cache_fname;         /* Where the plan is cached, if it is        */
+   struct file_stamp script_stamp;
+   struct file_stamp def_stamp;
+   struct plan_op * cache_ops; /* The pieces, as loaded from the cache      */
+   int ncache_ops;
 };
+#define OUT_STDIO  0
+#define OUT_WRITEV 1
+/*
+ * Elapsed time in seconds, for reporting rates
+ */
+static double fc_now()
+{
+#ifdef LINUX
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec)/1000000000.0;
+#else
+struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + ((double) tv.tv_usec)/1000000.0;
+#endif
+}
+#ifndef FC_BENCH
+/*
+ * Open the hardware counters for -H. They count for all the threads of the
+ * process, in user mode only, so that the usual perf_event_paranoid setting
+ * allows them. Returns 0 if none of them can be had.
+ */
+static int hw_open(sp)
+struct run_stats * sp;
+{
+#ifdef LINUX
+struct perf_event_attr pe;
+static int hw_config[HW_COUNT] = {PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES};
+int i;
+
+    for (i = 0; i < HW_COUNT; i++)
+    {
+        memset((unsigned char *) &pe, 0, sizeof(pe));
+        pe.type = PERF_TYPE_HARDWARE;
+        pe.size = sizeof(pe);
+        pe.config = hw_config[i];
+        pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pe.inherit = 1;
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        if ((sp->hw_fd[i] = (int) syscall(SYS_perf_event_open, &pe, 0, -1,
+                                     -1, 0)) >= 0)
+            sp->hw_on = 1;
+    }
+    if (!sp->hw_on)
+        perror("perf_event_open()");
+    return sp->hw_on;
+#else
+    return 0;
+#endif
+}
+/*
+ * Read the hardware counters, scaled up for any time the kernel had to share
+ * them out with others; -1 for any not there.
+ */
+static void hw_read(sp, vals)
+struct run_stats * sp;
+long long * vals;
+{
+#ifdef LINUX
+unsigned long long buf[3];     /* Value, time enabled, time running */
+int i;
+
+    for (i = 0; i < HW_COUNT; i++)
+    {
+        if (sp->hw_fd[i] < 0
+         || read(sp->hw_fd[i], buf, sizeof(buf)) != sizeof(buf))
+            vals[i] = -1;
+        else
+        if (buf[2] > 0 && buf[2] < buf[1])
+            vals[i] = (long long) (((double) buf[0]) * buf[1] / buf[2]);
+        else
+            vals[i] = (long long) buf[0];
+    }
+#endif
+    return;
+}
+/*
+ * Start the clock, and the counters, on a phase
+ */
+static double phase_start(scp)
+struct scenario * scp;
+{
+    if (scp->stats.hw_on)
+        hw_read(&scp->stats, scp->stats.hw_last);
+    return fc_now();
+}
+/*
+ * Charge the time since started to a phase, and return the time now, for the
+ * start of the next.
+ */
+static double phase_end(scp, phase, started)
+struct scenario * scp;
+int phase;
+double started;
+{
+double now = fc_now();
+long long vals[HW_COUNT];
+int i;
+
+    if (scp->stats.hw_on)
+    {
+        hw_read(&scp->stats, vals);
+        for (i = 0; i < HW_COUNT; i++)
+        {
+            if (vals[i] >= 0)
+                scp->stats.hw[phase][i] += vals[i] - scp->stats.hw_last[i];
+            else
+                scp->stats.hw[phase][i] = -1;      /* Not to be had */
+            scp->stats.hw_last[i] = vals[i];
+        }
+    }
+    scp->stats.secs[phase] += now - started;
+    FCT_SPAN(phase_names[phase], scp->pid, 0, started * 1000000.0);
+    return now;
+}
+#endif
 /*
- * Track data files
+ * Find what a bundle takes from the data file in a slot, making room for it if
+ * this is a slot the bundle hasn't seen before.
  */
-struct file_control * track_data_file(wcp, def_rp)
+static struct data_share * bundle_share(wcp, slot)
 struct write_control * wcp;
-struct row * def_rp;
+int slot;
+{
+    if (slot >= wcp->nshares)
+    {
+        wcp->shares = (struct data_share *) realloc(wcp->shares,
+                          sizeof(struct data_share) * (slot + 1));
+        memset((char *) (wcp->shares + wcp->nshares), 0,
+                  sizeof(struct data_share) * (slot + 1 - wcp->nshares));
+        wcp->nshares = slot + 1;
+    }
+    return &wcp->shares[slot];
+}
+/*
+ * Find a data file on the scenario chain, adding it if it is not there. Each
+ * different data file is only tracked once for the whole scenario, however
+ * many bundles use it. The name is taken over, or freed if already known.
+ */
+static struct file_control * find_data_file(scp, def_fname)
+struct scenario * scp;
+char * def_fname;
 {
 struct file_control * fcp;
 struct file_control * fcp1;
-char * def_fname;
 
-    def_fname = (char *) malloc(strlen(path_home) + strlen(def_rp->colp[2])
-                  + 10);
-    sprintf(def_fname, "%s/data/%s.db", path_home, def_rp->colp[2]);
+HIPT * h;
+
 /*
  * See if we have already encountered this data file
  */
-    for (fcp = wcp->data_anchor;
-            fcp != NULL
-         && strcmp(fcp->fname, def_fname);
-                fcp = fcp->next_file);
-/*
- * If we have already seen this data file, and this entry is an F, increment
- * the rows.
- */
-    if (fcp != NULL)
+    if (scp->data_names == NULL)
+        scp->data_names = hash(256, string_hh, (COMPFUNC) strcmp);
+    if ((h = lookup(scp->data_names, def_fname)) != NULL)
     {
-        if (def_rp->colp[4][0] == 'F')
-            fcp->content.data.recs += 1;
+        fcp = (struct file_control *) h->body;
         free(def_fname);
-        return fcp;
     }
+    else
+    {
 /*
  * Otherwise, we need to allocate a new file_control structure for the data
  * file. We don't do anything with it at this stage.
  */
-    if ((fcp = (struct file_control *) malloc(sizeof(struct file_control)))
+        if ((fcp = (struct file_control *) malloc(sizeof(struct file_control)))
                  == NULL)
-        return NULL;
-    memset(fcp, 0, sizeof(struct file_control));
-    fcp->fname = def_fname;
-    if (wcp->data_anchor == NULL)
-        wcp->data_anchor = fcp;
-    else
-    {
-        for (fcp1 = wcp->data_anchor;
-                fcp1->next_file != NULL;
-                    fcp1 = fcp1->next_file);
-        fcp1->next_file = fcp;
+            return NULL;
+        memset(fcp, 0, sizeof(struct file_control));
+        fcp->fname = def_fname;
+        fcp->slot = scp->data_cnt++;
+        insert(scp->data_names, fcp->fname, (char *) fcp);
+        if (scp->data_anchor == NULL)
+            scp->data_anchor = fcp;
+        else
+        {
+            for (fcp1 = scp->data_anchor;
+                    fcp1->next_file != NULL;
+                        fcp1 = fcp1->next_file);
+            fcp1->next_file = fcp;
+        }
     }
-    fcp->content.data.recs = (def_rp->colp[4][0] == 'F') ? 2 : 1;
     return fcp;
 }
 /*
- * Functions for writing out scripts etc.
+ * Track the data file for a def file row. If count_flag is set, the file is
+ * noted as one the bundle takes rows from; count_rows_taken() says how many.
  */
-void write_script_frag(ofp, pp)
-FILE * ofp;
-struct piece * pp;
+struct file_control * track_data_file(wcp, def_rp, count_flag)
+struct write_control * wcp;
+struct row * def_rp;
+int count_flag;
+{
+struct file_control * fcp;
+struct data_share * dsp;
+char * def_fname;
+
+    def_fname = (char *) malloc(strlen(path_home) + strlen(def_rp->colp[2])
+                  + 10);
+    sprintf(def_fname, "%s/data/%s.db", path_home, def_rp->colp[2]);
+    if ((fcp = find_data_file(wcp->scp, def_fname)) == NULL || !count_flag)
+        return fcp;
+    dsp = bundle_share(wcp, fcp->slot);
+    if (dsp->per_trans == 0)
+        dsp->per_trans = 1;
+    return fcp;
+}
+/*
+ * Find the data files for the def file lines
+ */
+static void resolve_def_rows(wcp, count_flag)
+struct write_control * wcp;
+int count_flag;
 {
-    fwrite(pp->p, sizeof(char), pp->len, ofp);
+int i;
+
+    for (i = 0; i < wcp->def_file.content.data.recs; i++)
+    {
+/*
+ * Before this allocation, rowp points within the single allocation for the
+ * row, so it doesn't need to be free()ed.
+ */
+        wcp->def_file.content.data.rows[i]->rowp = (char *)
+           track_data_file(wcp, wcp->def_file.content.data.rows[i], count_flag);
+    }
     return;
 }
 /*
- * Functions for writing out scripts etc.
+ * Resolve each def file row to the column it takes from its data file, with
+ * the headings of each data file hashed once, rather than looking the column
+ * up every time the row matches. Only the headings are read; the rows are not
+ * wanted until the scripts have been gone through. The rows naming a data file
+ * without a heading, or a column that it does not have, are all reported now,
+ * before the script is scanned; their matches are then left alone. With -c,
+ * the data files need not exist yet; the matches count whatever the column.
  */
-void write_sub_frag(ofp, pp)
-FILE * ofp;
-struct piece * pp;
+#define DEF_NO_COL  -1
+#define DEF_NO_ROWS -2
+static void resolve_def_cols(wcp)
+struct write_control * wcp;
 {
-    if (pp->p[0] == 'F')
+struct scenario * scp = wcp->scp;
+struct row_track * rtp = &wcp->def_file.content.data;
+struct file_control * fcp;
+struct row * rp;
+struct row * hp;
+HIPT * h;
+int i;
+int j;
+
+    if (scp->ncol_names < scp->data_cnt)
     {
-        pp->fcp->content.data.cur_row++;
-        if (pp->fcp->content.data.cur_row >= pp->fcp->content.data.recs)
-            pp->fcp->content.data.cur_row = 0;
+        scp->col_names = (HASH_CON **) realloc(scp->col_names,
+                            sizeof(HASH_CON *) * scp->data_cnt);
+        memset((char *) (scp->col_names + scp->ncol_names), 0,
+                  sizeof(HASH_CON *) * (scp->data_cnt - scp->ncol_names));
+        scp->ncol_names = scp->data_cnt;
     }
+    wcp->def_col = (int *) malloc(sizeof(int) * (rtp->recs + 1));
+    for (i = 0; i < rtp->recs; i++)
+    {
+        rp = rtp->rows[i];
+        fcp = (struct file_control *) rp->rowp;
+        if (fcp != NULL && scp->count_flag && !get_data_heading(fcp))
+        {
+            wcp->def_col[i] = 0;
+            continue;
+        }
+        if (fcp == NULL || !get_data_heading(fcp))
+        {
+            wcp->def_col[i] = DEF_NO_ROWS;
+            wcp->user_errors++;
+fprintf(stderr, "User Error: data file %s for (%s|%s|%s|%s|%s) cannot supply rows\n",
+                    (fcp == NULL) ? (char *) rp->colp[2] : fcp->fname,
+                    rp->colp[0], rp->colp[1], rp->colp[2], rp->colp[3],
+                    rp->colp[4]);
+            continue;
+        }
 /*
- * We have not preserved the original length of the substitution, so this
- * program does not honour the 'No variable length substitution' setting.
- */ 
-    if (pp->len < pp->fcp->content.data.col_defs->cols)
-        fputs(pp->fcp->content.data.rows[pp->fcp->content.data.cur_row]->colp[
-                      pp->len], ofp);
+ * The first column of a name is the one that counts, as it always has been
+ */
+        hp = fcp->content.data.col_defs;
+        if (scp->col_names[fcp->slot] == NULL)
+        {
+            scp->col_names[fcp->slot] = hash(2 * hp->cols + 1, string_hh,
+                                               (COMPFUNC) strcmp);
+            for (j = 0; j < hp->cols; j++)
+                if (lookup(scp->col_names[fcp->slot], hp->colp[j]) == NULL)
+                    insert(scp->col_names[fcp->slot], hp->colp[j],
+                             (char *) (hp->colp + j));
+        }
+        if ((h = lookup(scp->col_names[fcp->slot], rp->colp[3])) != NULL)
+            wcp->def_col[i] = ((unsigned char **) h->body) - hp->colp;
+        else
+        {
+            wcp->def_col[i] = DEF_NO_COL;
+            wcp->user_errors++;
+fprintf(stderr, "User Error: (%s|%s|%s|%s|%s) does not match any of the columns %s in %s\n",
+                    rp->colp[0], rp->colp[1], rp->colp[2], rp->colp[3],
+                    rp->colp[4], hp->rowp, fcp->fname);
+        }
+    }
     return;
 }
 /*
- * Read a script file in to memory
+ * Read a script file in to memory. Where we can, the script is mapped rather
+ * than read, and the pieces point straight in to the mapping. Either way, the
+ * text is not NUL terminated; scanning must go by length.
  */
-int get_script(fcp)
-struct file_control * fcp;
+int get_script(wcp)
+struct write_control * wcp;
 {
+struct file_control * fcp = &wcp->script_file;
 struct stat path_stat;
 FILE * fp;
 
@@ -208,23 +649,50 @@ FILE * fp;
     fcp->content.piece_anchor = (struct piece *) malloc(sizeof(struct piece));
     memset(fcp->content.piece_anchor, 0, sizeof(struct piece));
     fcp->content.piece_anchor->len = path_stat.st_size;
-    if ((fcp->content.piece_anchor->p =
-          (char *) malloc( path_stat.st_size)) == NULL)
+    fcp->content.piece_anchor->kind = PIECE_TEXT;
+    wcp->script_len = path_stat.st_size;
+    wcp->script_mapped = 0;
+#ifdef LINUX
+    if (path_stat.st_size > 0)
+    {
+    int fd;
+
+        if ((fd = open(fcp->fname, O_RDONLY)) < 0)
+        {
+            fprintf(stderr, "Script file %s open() error\n", fcp->fname);
+            perror("open()");
+            return 0;     /* Cannot open file */
+        }
+        wcp->script_base = (char *) mmap(NULL, path_stat.st_size, PROT_READ,
+                              MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (wcp->script_base != (char *) MAP_FAILED)
+        {
+            wcp->script_mapped = 1;
+            fcp->content.piece_anchor->p = wcp->script_base;
+            return 1;
+        }
+    }
+#endif
+/*
+ * Otherwise, read it
+ */
+    if ((wcp->script_base = (char *) malloc(path_stat.st_size + 1)) == NULL)
     {
-        fprintf(stderr, "Could not allocate %u to read file %s\n",
-                   path_stat.st_size, fcp->fname);
+        fprintf(stderr, "Could not allocate %lu to read file %s\n",
+                   (unsigned long) path_stat.st_size, fcp->fname);
         return 0;
     }
+    fcp->content.piece_anchor->p = wcp->script_base;
     if ((fp = fopen(fcp->fname, "rb")) == NULL)
     {
         fprintf(stderr, "Script file %s fopen() error\n", fcp->fname);
         perror("fopen()");
-        free(fcp->content.piece_anchor->p);
+        free(wcp->script_base);
         return 0;     /* Cannot open file */
     }
-    fread(fcp->content.piece_anchor->p, sizeof(char), path_stat.st_size, fp);
+    fread(wcp->script_base, sizeof(char), path_stat.st_size, fp);
     fclose(fp);
-    fcp->content.piece_anchor->write_fun = write_script_frag;
     return 1;
 }
 /*
@@ -248,8 +716,8 @@ struct piece* r2 = *((struct piece**) s2);
         if (r1->len > r2->len)
             return -1;
         else
-        if (r1->len > r2->len)
-            return -1;
+        if (r1->len < r2->len)
+            return 1;
         else
             return 0;
     }
@@ -279,7 +747,7 @@ int l2;
     if (l1 < l2)
         return -1;
     else
-    if (l2 > l1)
+    if (l1 > l2)
         return 1;
     else
         return 0;
@@ -323,6 +791,22 @@ int i;
     fcp->fp = NULL;
     return 1;
 }
+/*
+ * Read a bundle's def file, counting what was read
+ */
+static int read_def(wcp)
+struct write_control * wcp;
+{
+struct row_track * rtp = &wcp->def_file.content.data;
+int i;
+
+    if (!get_def(&wcp->def_file))
+        return 0;
+    wcp->scp->stats.rows_parsed += rtp->recs;
+    for (i = 0; i < rtp->recs; i++)
+        wcp->scp->stats.bytes_read += rtp->rows[i]->len + 1;
+    return 1;
+}
 /*
  * Break a piece in to two or three based on a range. Return the piece inserted.
  */
@@ -349,7 +833,7 @@ struct piece * nnpp;
         pp->next_piece = npp;
         pp->p = begp;
         pp->len = (endp - begp) + 1;
-        npp->write_fun = pp->write_fun;
+        npp->kind = pp->kind;
         return pp; 
     }
     else
@@ -363,7 +847,7 @@ struct piece * nnpp;
         pp->next_piece = npp;
         npp->p = begp;
         npp->len = (endp - begp) + 1;
-        npp->write_fun = pp->write_fun;
+        npp->kind = pp->kind;
         return npp;
     }
     else
@@ -380,11 +864,45 @@ struct piece * nnpp;
         npp->p = begp;
         npp->len = (endp - begp) + 1;
         pp->len = begp - pp->p;
-        npp->write_fun = pp->write_fun;
-        nnpp->write_fun = pp->write_fun;
+        npp->kind = pp->kind;
+        nnpp->kind = pp->kind;
         return npp;
     }
 }
+/*
+ * Chain up the places on a line where the MATCH for def file row j was found,
+ * each tagged with j. Returns how many there were.
+ */
+static int chain_matches(wcp, j, nhits, mppp)
+struct write_control * wcp;
+int j;
+int nhits;
+struct piece ** mppp;
+{
+struct ac_hit * hp;
+struct piece * nnpp;
+int word = wcp->def_word[j];
+int cnt;
+
+    if (word < 0)
+        return 0;
+    for (cnt = 0, hp = wcp->hits; nhits > 0; nhits--, hp++)
+    {
+        if (hp->word != word)
+            continue;
+        nnpp = (struct piece *) malloc(sizeof(struct piece));
+        nnpp->next_piece = *mppp;
+        *mppp = nnpp;
+/*
+ * Provide a back pointer
+ */
+        nnpp->fcp = (struct file_control *) (0x7ffffffL & j);
+        nnpp->p = hp->p;
+        nnpp->len = wcp->matcher->word_len[word];
+        cnt++;
+    }
+    return cnt;
+}
 /*
  * Sort out the substitutions that will apply to a single line. This code
  * deals with multiple substitutions, and overlapping substitutions in the
@@ -398,6 +916,8 @@ struct piece * nnpp;
  *     are handle by repeating the def file line as many times as required. The
  *     logic will apply one to the first, another to the second, until matches
  *     or def file lines applying to this line are exhausted.
+ * -   A def file line with a LINE_NO of '*' applies to every line of the
+ *     script on which its MATCH is found.
  */
 static struct piece * sort_out_one_line(wcp, row, npp, xp, ep)
 struct write_control * wcp;
@@ -407,26 +927,24 @@ char * xp;
 char * ep;
 {
 int matches = 0;
-struct bm_table * sub_match;
-char * mp;
+int nhits;
 struct piece ** spp;
 struct piece ** xspp;
 struct piece * nnpp;
 struct piece * mpp;
 int i;
 int j;
+#ifdef FC_TRACE
+char tbuf[24];
+#endif
+FCT_DECL(t0)
 
+    FCT_START(t0);
 #ifdef DEBUG
     fprintf(stderr, "Line: %d (%.*s)\n", row, (ep - xp), xp);
 #endif
-    mpp = NULL;      /* Chain of matches on this line */
-    while ( row == atoi(
-     wcp->def_file.content.data.rows[wcp->def_file.content.data.cur_row]
-                           ->colp[0]))
-    {
 /*
- * If it does, check the match, and if it does match, construct the re-write
- * instructions and interpose them in the current piece as above.
+ * Find everything that the def file is looking for on this line in one go.
  *
  * There could be problems with the algorithm that maintains the piece chain if
  * there are multiple matches for the same line.
@@ -436,10 +954,19 @@ int j;
  * Solution: Find all possible matches, sort them into ascending order, and
  * then pick them off one at a time.
  */
-        sub_match = bm_compile(
-  wcp->def_file.content.data.rows[wcp->def_file.content.data.cur_row]->colp[1]);
-        if ((mp = bm_match(sub_match, xp, ep)) == NULL)
+    nhits = ac_match(wcp->matcher, xp, ep, &wcp->hits, &wcp->hit_alloc);
+    mpp = NULL;      /* Chain of matches on this line */
+    while (wcp->def_file.content.data.cur_row < wcp->def_file.content.data.recs
+      && row == wcp->def_line[wcp->def_file.content.data.cur_row])
+    {
+/*
+ * If it does, check the match, and if it does match, construct the re-write
+ * instructions and interpose them in the current piece as above.
+ */
+        if ((i = chain_matches(wcp, wcp->def_file.content.data.cur_row,
+                       nhits, &mpp)) == 0)
         {
+            wcp->user_errors++;
             fprintf(stderr, "User Error: (%s|%s|%s|%s|%s) does not match %s\n",
   wcp->def_file.content.data.rows[wcp->def_file.content.data.cur_row]->colp[0],
   wcp->def_file.content.data.rows[wcp->def_file.content.data.cur_row]->colp[1],
@@ -448,44 +975,17 @@ int j;
   wcp->def_file.content.data.rows[wcp->def_file.content.data.cur_row]->colp[4],
                     wcp->script_file.fname);
         }
-        else
-        {
-            do
-            {
-                matches++;
-                if (mpp == NULL)
-                {
-                    mpp = (struct piece *) malloc(sizeof(struct piece));
-                    mpp->next_piece = NULL;
-                }
-                else
-                {
-                    nnpp = (struct piece *) malloc(sizeof(struct piece));
-                    nnpp->next_piece = mpp;
-                    mpp = nnpp;
-                }
-/*
- * Provide a back pointer
- */
-                mpp->fcp = (struct file_control *) (0x7ffffffL &  
-                             wcp->def_file.content.data.cur_row);
-                mpp->p = mp; 
-                mpp->len = sub_match->match_len; 
-            }
-            while ((mp = bm_match(sub_match, mp + 1, ep)) != NULL);
-        }
-        free(sub_match);
+        matches += i;
         wcp->def_file.content.data.cur_row++;
-        if ( wcp->def_file.content.data.cur_row >=
-             wcp->def_file.content.data.recs)
-        {
+    }
 /*
- * Signal that no more def file processing is needed
+ * The wildcard rows can match on any line
  */
-            free(wcp->def_file.fname);
-            wcp->def_file.fname = NULL;
-            break;
-        }
+    for (j = 0; j < wcp->nwild; j++)
+    {
+        i = chain_matches(wcp, wcp->wild[j], nhits, &mpp);
+        wcp->wild_hits[j] += i;
+        matches += i;
     }
 /*
  * If there are matches, find out which ones will actually apply, and to what
@@ -523,38 +1023,15 @@ int j;
                                         /* The corresponding data row */
                 npp->fcp = (struct file_control *)
                           (wcp->def_file.content.data.rows[j]->rowp);
-                if ( npp->fcp->content.data.recs <= 0)
-                {
-fprintf(stderr, "User Error: data file %s for (%s|%s|%s|%s|%s) cannot supply rows\n",
-                    npp->fcp->fname,
-                                wcp->def_file.content.data.rows[j]->colp[0],
-                                wcp->def_file.content.data.rows[j]->colp[1],
-                                wcp->def_file.content.data.rows[j]->colp[2],
-                                wcp->def_file.content.data.rows[j]->colp[3],
-                                wcp->def_file.content.data.rows[j]->colp[4]);
-                }
-                else
-                {
-                    npp->write_fun = write_sub_frag;
-                    for (npp->len = 0;
-                             npp->len < npp->fcp->content.data.col_defs->cols;
-                                 npp->len++)
-                        if (!strcmp(
-                          npp->fcp->content.data.col_defs->colp[npp->len],
-                          (wcp->def_file.content.data.rows[j]->colp[3])))
-                            break;
-                    if (npp->len >= npp->fcp->content.data.col_defs->cols)
-                    {
-fprintf(stderr, "User Error: (%s|%s|%s|%s|%s) does not match any of the columns %s in %s\n",
-                            wcp->def_file.content.data.rows[j]->colp[0],
-                            wcp->def_file.content.data.rows[j]->colp[1],
-                            wcp->def_file.content.data.rows[j]->colp[2],
-                            wcp->def_file.content.data.rows[j]->colp[3],
-                            wcp->def_file.content.data.rows[j]->colp[4],
-                                          npp->fcp->content.data.col_defs->rowp,
-                                          npp->fcp->fname);
-                    }
-                    npp->p = wcp->def_file.content.data.rows[j]->colp[4];
+                if (wcp->def_col[j] != DEF_NO_ROWS)
+                {                        /* Otherwise reported already */
+                    npp->kind = PIECE_SUB;
+                    npp->match_len = (*xspp)->len;
+                    npp->len = (wcp->def_col[j] == DEF_NO_COL) ?
+                               npp->fcp->content.data.col_defs->cols :
+                               wcp->def_col[j];
+                    npp->fresh =
+                       (wcp->def_file.content.data.rows[j]->colp[4][0] == 'F');
 /*
  * Now prevent any further matches for this pattern being applied
  */ 
@@ -565,6 +1042,8 @@ fprintf(stderr, "User Error: (%s|%s|%s|%s|%s) does not match any of the columns
                 }
                 npp = npp->next_piece;
             } 
+            else
+                wcp->scp->stats.rejected++;
         }
 /*
  * Free the match list
@@ -577,293 +1056,3179 @@ fprintf(stderr, "User Error: (%s|%s|%s|%s|%s) does not match any of the columns
         if (matches > 1)
             free(spp);
     }
+#ifdef FC_TRACE
+    sprintf(tbuf, "line %d", row);
+#endif
+    FCT_SPAN("sort_out_one_line", tbuf, matches, t0);
     return npp;
 }
 /*
- * Complete the data structures that will drive the clone operation.
+ * Flatten the piece chain into an array of plan steps, resolving each
+ * substitution to its data file slot and column, and counting the rows that a
+ * transaction takes from each data file; one for the bump at the end of the
+ * transaction, plus one for each 'F' substitution. The pieces are finished
+ * with afterwards, but the script text they point at is not.
  */
-static void assemble_clone_instructions(wcp, think_time_buf)
+static struct clone_plan * compile_plan(wcp, think_time_buf)
 struct write_control * wcp;
 char * think_time_buf;
 {
-/*
- * The script file starts as one big piece. We now need to go through the file,
- * marking out:
- * -  \Wn\ substitutions (where the think time is going)
- * -  Def file substitutions, if applicable
- */
-int row;
+struct clone_plan * cpp;
+struct plan_op * op;
 struct piece * npp;
 struct piece * nnpp;
-struct piece * mpp;
-char * xp;
-char * ep;
+struct file_control * dfp;
+int n;
 
-/*
- * Start at the beginning of the script
- * Initialise the def file substitution tracker
- * Initialise the piece we are in on the script.
- * Initialise line counter
- */
-    for (xp = wcp->script_file.content.piece_anchor->p,
-         ep = strchr(xp, '\n'),
-         row = 1,
-         npp = wcp->script_file.content.piece_anchor;
-         xp < npp->p + npp->len;
-              xp = ep + 1, ep = strchr(xp, '\n'), row++)
+    cpp = (struct clone_plan *) malloc(sizeof(struct clone_plan));
+    for (n = 0, npp = wcp->script_file.content.piece_anchor;
+             npp != NULL;
+                 npp = npp->next_piece)
+        n++;
+    cpp->ops = (struct plan_op *) malloc(sizeof(struct plan_op) * (n + 1));
+    cpp->nsrcs = wcp->scp->data_cnt;
+    cpp->srcs = (struct plan_src *) malloc(sizeof(struct plan_src) *
+                                      (cpp->nsrcs + 1));
+    cpp->cons = (int *) malloc(sizeof(int) * (cpp->nsrcs + 1));
+    for (dfp = wcp->scp->data_anchor; dfp != NULL; dfp = dfp->next_file)
     {
-/*
- * Delineate the line.
- */
-        if (ep == NULL)
-            ep = npp->p + npp->len - 1;
-/*
- * See if it has a W directive on it.
- * If it does, split the current piece, and interpose the W directive writer.
- * This could be before, in, or after, the current piece. The write function
- * is the same as for a fragment of script.
- */
-        if (*xp =='\\' && *(xp + 1) == 'W' && *(ep - 1) == '\\')
+        cpp->srcs[dfp->slot].index = dfp->content.data.index;
+        cpp->srcs[dfp->slot].row0 = 0;
+        if (dfp->slot < wcp->nshares && wcp->shares[dfp->slot].per_trans > 0)
         {
-            npp = update_pieces(npp, xp, ep);
-            npp->p = think_time_buf;
-            npp->len = strlen(think_time_buf);
-            npp = npp->next_piece;
+            cpp->srcs[dfp->slot].first = wcp->shares[dfp->slot].first;
+            cpp->srcs[dfp->slot].recs = wcp->shares[dfp->slot].recs;
+            cpp->cons[dfp->slot] = 1;
         }
-/*
- * Otherwise, see if the line matches the current def file target.
- */
         else
-        if (wcp->def_file.fname != NULL && row == atoi(
-             wcp->def_file.content.data.rows[wcp->def_file.content.data.cur_row]
-                           ->colp[0]))
-            npp = sort_out_one_line(wcp, row, npp, xp, ep);
-#ifdef DEBUG
+        {
+            cpp->srcs[dfp->slot].first = 0;
+            cpp->srcs[dfp->slot].recs = 0;
+            cpp->cons[dfp->slot] = 0;
+        }
+    }
+    for (op = cpp->ops, npp = wcp->script_file.content.piece_anchor;
+             npp != NULL;
+                 npp = nnpp)
+    {
+        nnpp = npp->next_piece;
+        if (npp->kind == PIECE_SUB)
+        {
+            op->op = PLAN_COL;
+            op->fresh = npp->fresh;
+            op->slot = npp->fcp->slot;
+            op->col = (npp->len < npp->fcp->content.data.col_defs->cols) ?
+                        (int) npp->len : -1;
+            op->p = NULL;
+            op->len = npp->match_len;
+            if (op->fresh)
+                cpp->cons[op->slot]++;
+            op++;
+        }
+        else
+        if (npp->len > 0)
+        {
+/*
+ * Fixed text that carries straight on from the previous step is merged in
+ */
+            if (op > cpp->ops && npp->p != think_time_buf
+              && (op - 1)->op == PLAN_SPAN
+              && (op - 1)->p + (op - 1)->len == npp->p)
+                (op - 1)->len += npp->len;
+            else
+            {
+                op->op = (npp->p == think_time_buf) ? PLAN_THINK : PLAN_SPAN;
+                op->fresh = 0;
+                op->slot = 0;
+                op->col = -1;
+                op->p = npp->p;
+                op->len = npp->len;
+                op++;
+            }
+        }
+        if (npp != wcp->script_file.content.piece_anchor)
+            free(npp);
+    }
+    wcp->script_file.content.piece_anchor->next_piece = NULL;
+    cpp->nops = op - cpp->ops;
+    wcp->scp->stats.pieces += cpp->nops;
+    return cpp;
+}
+/*
+ * The plan cache.
+ *
+ * Working out where the substitutions go means reading and sorting the def
+ * file and scanning the whole script. For a big script that takes a while, and
+ * it comes out the same every time until the script, the def file or the
+ * headings of the data files change; the numbers of users and transactions
+ * make no difference. So the piece chain is saved next to the script, as:
+ *
+ * FASTCLONE PLAN 2
+ * SCRIPT|size|mtime|hash
+ * DEF|size|mtime|hash          (all -1 and an empty hash if there isn't one)
+ * DATA|per_trans|hash|file     (the hash is of the heading line)
+ * S|offset|length              (script text)
+ * T                            (think time)
+ * C|data|column|fresh|length   (data column; data counts the DATA lines,
+ *                              and length is that of the text replaced)
+ * END|pieces
+ *
+ * It is only used if everything it depends on still matches. It isn't written
+ * if the def file gave rise to any errors, so they go on being reported.
+ */
+#define PLAN_MAGIC "FASTCLONE PLAN 2\n"
+#define FNV_BASIS  0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+static unsigned long long fnv_hash(h, p, len)
+unsigned long long h;
+unsigned char * p;
+unsigned long len;
+{
+    for (; len > 0; len--, p++)
+    {
+        h ^= *p;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+/*
+ * Stamp a file. If the text is already in memory, that is what is hashed.
+ * If line_only is set, only the first line is hashed, and the size and time
+ * are left out; it is only the heading of a data file that matters. Returns 0,
+ * leaving the stamp of a missing file, if the file cannot be read.
+ */
+static int file_stamp(fname, line_only, text, len, fsp)
+char * fname;
+int line_only;
+char * text;
+unsigned long len;
+struct file_stamp * fsp;
+{
+struct stat path_stat;
+unsigned char buf[8192];
+unsigned char * xp;
+FILE * fp;
+int n;
+
+    fsp->size = -1;
+    fsp->mtime = -1;
+    fsp->hash = FNV_BASIS;
+    if (fname == NULL || (fp = fopen(fname, "rb")) == NULL)
+        return 0;
+    if (!line_only)
+    {
+        if (fstat(fileno(fp), &path_stat) < 0)
+        {
+            fclose(fp);
+            return 0;
+        }
+        fsp->size = path_stat.st_size;
+        fsp->mtime = path_stat.st_mtime;
+    }
+    if (text != NULL)
+        fsp->hash = fnv_hash(fsp->hash, (unsigned char *) text, len);
+    else
+    while ((n = fread(buf, sizeof(char), sizeof(buf), fp)) > 0)
+    {
+        if (line_only && (xp = memchr(buf, '\n', n)) != NULL)
+        {
+            fsp->hash = fnv_hash(fsp->hash, buf, (xp - buf) + 1);
+            break;
+        }
+        fsp->hash = fnv_hash(fsp->hash, buf, n);
+    }
+    fclose(fp);
+    return 1;
+}
+#ifndef FC_BENCH
+static int stamp_matches(buf, tag, fsp)
+char * buf;
+char * tag;
+struct file_stamp * fsp;
+{
+long long size;
+long long mtime;
+unsigned long long hash;
+int n = strlen(tag);
+
+    return (!strncmp(buf, tag, n) && buf[n] == '|'
+         && sscanf(buf + n + 1, "%lld|%lld|%llx", &size, &mtime, &hash) == 3
+         && size == fsp->size && mtime == fsp->mtime && hash == fsp->hash);
+}
+/*
+ * Load the cached plan for a bundle, if it is still good. Nothing changes
+ * unless it is. The data files it names are added to the scenario, with the
+ * rows a transaction needs from each, so the def file need not be read.
+ */
+static int load_plan_cache(wcp)
+struct write_control * wcp;
+{
+FILE * fp;
+char buf[4096];
+char * xp;
+struct file_stamp fs;
+unsigned long long hash;
+char ** dnames = NULL;
+int * dper = NULL;
+int ndata = 0;
+struct plan_op * ops = NULL;
+int nops = 0;
+int alloc = 0;
+int done = 0;
+int data;
+int col;
+int fresh;
+unsigned long off;
+unsigned long len;
+int i;
+
+    if ((fp = fopen(wcp->cache_fname, "rb")) == NULL)
+        return 0;
+    if (fgets(buf, sizeof(buf), fp) == NULL || strcmp(buf, PLAN_MAGIC)
+     || fgets(buf, sizeof(buf), fp) == NULL
+     || !stamp_matches(buf, "SCRIPT", &wcp->script_stamp)
+     || fgets(buf, sizeof(buf), fp) == NULL
+     || !stamp_matches(buf, "DEF", &wcp->def_stamp))
+    {
+        fclose(fp);
+        return 0;
+    }
+    while (!done && fgets(buf, sizeof(buf), fp) != NULL)
+    {
+        if ((xp = strchr(buf, '\n')) == NULL)
+            break;
+        *xp = '\0';
+        if (nops >= alloc)
+        {
+            alloc = (alloc < 64) ? 64 : (alloc + alloc);
+            ops = (struct plan_op *) realloc(ops,
+                                    sizeof(struct plan_op) * alloc);
+        }
+        ops[nops].fresh = 0;
+        ops[nops].slot = 0;
+        ops[nops].col = -1;
+        ops[nops].p = NULL;
+        ops[nops].len = 0;
+        if (!strncmp(buf, "DATA|", 5))
+        {
+            if (nops > 0 || sscanf(buf + 5, "%d|%llx|", &i, &hash) != 2
+              || (xp = strchr(buf + 5, '|')) == NULL
+              || (xp = strchr(xp + 1, '|')) == NULL)
+                break;
+            dnames = (char **) realloc(dnames, sizeof(char *) * (ndata + 1));
+            dper = (int *) realloc(dper, sizeof(int) * (ndata + 1));
+            dnames[ndata] = (char *) malloc(strlen(path_home) + strlen(xp)
+                                 + 8);
+            sprintf(dnames[ndata], "%s/data/%s", path_home, xp + 1);
+            dper[ndata++] = i;
+            if (!file_stamp(dnames[ndata - 1], 1, NULL, 0, &fs)
+              || fs.hash != hash || i < 1)
+                break;
+        }
+        else
+        if (!strncmp(buf, "S|", 2))
+        {
+            if (sscanf(buf + 2, "%lu|%lu", &off, &len) != 2
+              || off + len > wcp->script_len)
+                break;
+            ops[nops].op = PLAN_SPAN;
+            ops[nops].p = wcp->script_base + off;
+            ops[nops++].len = len;
+        }
+        else
+        if (!strcmp(buf, "T"))
+            ops[nops++].op = PLAN_THINK;
+        else
+        if (!strncmp(buf, "C|", 2))
+        {
+            if (sscanf(buf + 2, "%d|%d|%d|%lu", &data, &col, &fresh, &len)
+                   != 4 || data < 0 || data >= ndata)
+                break;
+            ops[nops].op = PLAN_COL;
+            ops[nops].slot = data;
+            ops[nops].col = col;
+            ops[nops].len = len;
+            ops[nops++].fresh = fresh;
+        }
+        else
+        if (!strncmp(buf, "END|", 4))
+            done = (atoi(buf + 4) == nops);
+        else
+            break;
+    }
+    fclose(fp);
+    if (done)
+    {
+/*
+ * Put the data files on the scenario chain
+ */
+        for (i = 0; i < ndata; i++)
+        {
+            data = find_data_file(wcp->scp, dnames[i])->slot;
+            bundle_share(wcp, data)->per_trans = dper[i];
+            dper[i] = data;
+        }
+        for (i = 0; i < nops; i++)
+            if (ops[i].op == PLAN_COL)
+                ops[i].slot = dper[ops[i].slot];
+        wcp->cache_ops = ops;
+        wcp->ncache_ops = nops;
+    }
+    else
+    {
+        for (i = 0; i < ndata; i++)
+            free(dnames[i]);
+        if (ops != NULL)
+            free(ops);
+    }
+    if (dnames != NULL)
+    {
+        free(dnames);
+        free(dper);
+    }
+    return done;
+}
+#endif
+/*
+ * Save the piece chain that assemble_clone_instructions() has worked out. The
+ * cache is written under another name and renamed, so that a bundle being
+ * set up at the same time never sees half of it. Failing to write it is not
+ * an error.
+ */
+static void save_plan_cache(wcp, think_time_buf)
+struct write_control * wcp;
+char * think_time_buf;
+{
+FILE * fp;
+char * tmp;
+struct piece * npp;
+struct file_control * dfp;
+struct file_stamp fs;
+int * dno;
+int ndata;
+int n;
+int dlen = strlen(path_home) + 6;
+
+    tmp = (char *) malloc(strlen(wcp->cache_fname) + 24);
+    sprintf(tmp, "%s.%d", wcp->cache_fname, getpid());
+    if ((fp = fopen(tmp, "wb")) == NULL)
+    {
+        free(tmp);
+        return;
+    }
+    fputs(PLAN_MAGIC, fp);
+    fprintf(fp, "SCRIPT|%lld|%lld|%llx\n", wcp->script_stamp.size,
+              wcp->script_stamp.mtime, wcp->script_stamp.hash);
+    fprintf(fp, "DEF|%lld|%lld|%llx\n", wcp->def_stamp.size,
+              wcp->def_stamp.mtime, wcp->def_stamp.hash);
+    dno = (int *) malloc(sizeof(int) * (wcp->scp->data_cnt + 1));
+    for (ndata = 0, dfp = wcp->scp->data_anchor;
+             dfp != NULL;
+                 dfp = dfp->next_file)
+    {
+        dno[dfp->slot] = -1;
+        if (dfp->slot >= wcp->nshares
+          || wcp->shares[dfp->slot].per_trans == 0)
+            continue;
+        dno[dfp->slot] = ndata++;
+        file_stamp(dfp->fname, 1, NULL, 0, &fs);
+        fprintf(fp, "DATA|%d|%llx|%s\n", wcp->shares[dfp->slot].per_trans,
+                   fs.hash, dfp->fname + dlen);
+    }
+    for (n = 0, npp = wcp->script_file.content.piece_anchor;
+             npp != NULL;
+                 npp = npp->next_piece)
+    {
+        if (npp->kind == PIECE_SUB)
+            fprintf(fp, "C|%d|%d|%d|%lu\n", dno[npp->fcp->slot],
+                (npp->len < npp->fcp->content.data.col_defs->cols) ?
+                        (int) npp->len : -1, npp->fresh,
+                        npp->match_len);
+        else
+        if (npp->p == think_time_buf)
+            fputs("T\n", fp);
+        else
+        if (npp->len > 0)
+            fprintf(fp, "S|%lu|%lu\n", (unsigned long)
+                          (npp->p - wcp->script_base), npp->len);
+        else
+            continue;
+        n++;
+    }
+    fprintf(fp, "END|%d\n", n);
+    free(dno);
+    if (fclose(fp) != 0 || rename(tmp, wcp->cache_fname) < 0)
+        unlink(tmp);
+    free(tmp);
+    return;
+}
+/*
+ * Rebuild the piece chain from the cached plan. Returns 0 if a data file the
+ * plan uses now has no rows to give, in which case the def file has to be
+ * gone through after all, to report on it and leave the text alone.
+ */
+static int pieces_from_cache(wcp, think_time_buf)
+struct write_control * wcp;
+char * think_time_buf;
+{
+struct plan_op * op;
+struct piece * npp;
+struct file_control * dfp;
+int i;
+
+    for (i = 0, op = wcp->cache_ops; i < wcp->ncache_ops; i++, op++)
+        if (op->op == PLAN_COL && (op->slot >= wcp->nshares
+                                || wcp->shares[op->slot].recs <= 0))
+            return 0;
+    npp = wcp->script_file.content.piece_anchor;
+    npp->len = 0;
+    npp->next_piece = NULL;
+    for (i = 0, op = wcp->cache_ops; i < wcp->ncache_ops; i++, op++)
+    {
+        if (i > 0)
+        {
+            npp->next_piece = (struct piece *) malloc(sizeof(struct piece));
+            npp = npp->next_piece;
+            npp->next_piece = NULL;
+        }
+        npp->fcp = NULL;
+        if (op->op == PLAN_COL)
+        {
+            for (dfp = wcp->scp->data_anchor;
+                     dfp->slot != op->slot;
+                         dfp = dfp->next_file);
+            npp->kind = PIECE_SUB;
+            npp->fcp = dfp;
+            npp->p = NULL;
+            npp->fresh = op->fresh;
+            npp->len = (op->col < 0) ? (unsigned long) -1 : op->col;
+            npp->match_len = op->len;
+        }
+        else
+        {
+            npp->kind = PIECE_TEXT;
+            if (op->op == PLAN_THINK)
+            {
+                npp->p = think_time_buf;
+                npp->len = strlen(think_time_buf);
+            }
+            else
+            {
+                npp->p = op->p;
+                npp->len = op->len;
+            }
+        }
+    }
+    return 1;
+}
+/*
+ * Compile the MATCH strings from every def file row into one matcher, so that
+ * each script line that needs looking at is only scanned once.
+ *
+ * Rows without a usable LINE_NO sort to the front. Those with '*' apply to
+ * any line; any others are reported and ignored.
+ */
+static void prepare_matcher(wcp)
+struct write_control * wcp;
+{
+struct row_track * rtp = &wcp->def_file.content.data;
+struct row * rp;
+int i;
+
+    wcp->matcher = ac_new();
+    wcp->def_word = (int *) malloc(sizeof(int) * (rtp->recs + 1));
+    wcp->def_line = (int *) malloc(sizeof(int) * (rtp->recs + 1));
+    wcp->wild = (int *) malloc(sizeof(int) * (rtp->recs + 1));
+    wcp->nwild = 0;
+    for (i = 0; i < rtp->recs; i++)
+    {
+        rp = rtp->rows[i];
+        wcp->def_word[i] = ac_add(wcp->matcher, rp->colp[1],
+                                    strlen(rp->colp[1]));
+        wcp->def_line[i] = atoi(rp->colp[0]);
+        if (i != rtp->cur_row || wcp->def_line[i] > 0)
+            continue;
+        rtp->cur_row++;
+        if (!strcmp(rp->colp[0], "*"))
+            wcp->wild[wcp->nwild++] = i;
+        else
+        {
+            wcp->user_errors++;
+            fprintf(stderr, "User Error: (%s|%s|%s|%s|%s) has no line number\n",
+                    rp->colp[0], rp->colp[1], rp->colp[2], rp->colp[3],
+                    rp->colp[4]);
+        }
+    }
+    wcp->wild_hits = (int *) calloc(wcp->nwild + 1, sizeof(int));
+    ac_compile(wcp->matcher);
+    return;
+}
+/*
+ * Report the def file rows that never found anything, and release the matcher
+ */
+static void finish_matcher(wcp)
+struct write_control * wcp;
+{
+struct row * rp;
+int i;
+
+    for (i = 0; i < wcp->nwild; i++)
+    {
+        if (wcp->wild_hits[i] > 0)
+            continue;
+        rp = wcp->def_file.content.data.rows[wcp->wild[i]];
+        wcp->user_errors++;
+        fprintf(stderr, "User Error: (%s|%s|%s|%s|%s) does not match %s\n",
+                rp->colp[0], rp->colp[1], rp->colp[2], rp->colp[3],
+                rp->colp[4], wcp->script_file.fname);
+    }
+    for (i = wcp->def_file.content.data.cur_row;
+             i < wcp->def_file.content.data.recs;
+                 i++)
+    {
+        rp = wcp->def_file.content.data.rows[i];
+        wcp->user_errors++;
+        fprintf(stderr, "User Error: (%s|%s|%s|%s|%s) is beyond the end of %s\n",
+                rp->colp[0], rp->colp[1], rp->colp[2], rp->colp[3],
+                rp->colp[4], wcp->script_file.fname);
+    }
+    ac_free(wcp->matcher);
+    wcp->matcher = NULL;
+    free(wcp->def_word);
+    free(wcp->def_line);
+    free(wcp->def_col);
+    wcp->def_col = NULL;
+    free(wcp->wild);
+    free(wcp->wild_hits);
+    if (wcp->hits != NULL)
+        free(wcp->hits);
+    wcp->hits = NULL;
+    wcp->hit_alloc = 0;
+    return;
+}
+/*
+ * Go through the script, turning the piece chain in to the script text with
+ * the think times and the def file substitutions marked out. This is done
+ * before the data files are read, so that the rows each transaction takes are
+ * known; see scan_scripts().
+ */
+static void scan_script(wcp, think_time_buf)
+struct write_control * wcp;
+char * think_time_buf;
+{
+/*
+ * The script file starts as one big piece. We now need to go through the file,
+ * marking out:
+ * -  \Wn\ substitutions (where the think time is going)
+ * -  Def file substitutions, if applicable
+ */
+int row;
+int next;
+int t;
+struct line_index * lip;
+struct row_track * rtp = &wcp->def_file.content.data;
+struct piece * npp;
+char * xp;
+char * ep;
+char * limit = wcp->script_base + wcp->script_len;
+
+    wcp->scanned = 1;
+    if (wcp->def_file.fname != NULL)
+    {
+        if (wcp->def_col == NULL)
+            resolve_def_cols(wcp);
+        prepare_matcher(wcp);
+    }
+/*
+ * Find where all the lines start in one pass, noting the ones that might be
+ * think time directives. Then only the lines that something happens to need
+ * visiting, unless there are wildcard def file rows, which can apply anywhere.
+ */
+    lip = index_lines((unsigned char *) wcp->script_base, wcp->script_len,
+                          "\\W");
+    for (row = 0,
+         t = 0,
+         npp = wcp->script_file.content.piece_anchor;;)
+    {
+        next = (t < lip->nmarked) ? lip->marked[t] : (lip->nlines + 1);
+        if (wcp->def_file.fname != NULL)
+        {
+            if (wcp->nwild > 0)
+                next = row + 1;
+            else
+            if (rtp->cur_row < rtp->recs
+              && wcp->def_line[rtp->cur_row] > row
+              && wcp->def_line[rtp->cur_row] < next)
+                next = wcp->def_line[rtp->cur_row];
+        }
+        if (next > lip->nlines)
+            break;
+        row = next;
+        if (t < lip->nmarked && lip->marked[t] == row)
+            t++;
+/*
+ * Delineate the line.
+ */
+        xp = wcp->script_base + lip->start[row - 1];
+        ep = wcp->script_base + lip->start[row] - 1;
+/*
+ * See if it has a W directive on it.
+ * If it does, split the current piece, and interpose the W directive writer.
+ * This could be before, in, or after, the current piece. The write function
+ * is the same as for a fragment of script.
+ */
+        if (*xp =='\\' && xp + 1 < limit && *(xp + 1) == 'W'
+          && *(ep - 1) == '\\')
+        {
+            npp = update_pieces(npp, xp, ep);
+            npp->p = think_time_buf;
+            npp->len = strlen(think_time_buf);
+            npp = npp->next_piece;
+        }
+/*
+ * Otherwise, see if the line matches the current def file target.
+ */
+        else
+        if (wcp->def_file.fname != NULL
+          && (wcp->nwild > 0
+           || (rtp->cur_row < rtp->recs && row == wcp->def_line[rtp->cur_row])))
+            npp = sort_out_one_line(wcp, row, npp, xp, ep);
+#ifdef DEBUG
         else
+        if (wcp->def_file.fname != NULL && rtp->cur_row < rtp->recs)
         fprintf(stderr, "Script: %d Def: %d Match: (%s)\n", row, 
-             wcp->def_file.content.data.cur_row,
-             wcp->def_file.content.data.rows[wcp->def_file.content.data.cur_row]->colp[0]);
+             rtp->cur_row, rtp->rows[rtp->cur_row]->colp[0]);
 #endif
     }
+    zap_line_index(lip);
+    if (wcp->def_file.fname != NULL)
+        finish_matcher(wcp);
     return;
 }
 /*
- * Connect the lines in the def file to the data files, work out how many
- * records we are going to need from each, and read them unless all we are
- * doing is counting our requirement.
+ * Count the rows a transaction takes from each data file the bundle uses,
+ * just as compile_plan() will; one for the bump at the end of the
+ * transaction, plus one for each 'F' substitution actually made. A wildcard
+ * row takes one for every line it applies to, and a row that never matches
+ * takes none.
  */
-static void collect_needed_data(wcp, mult, count_flag)
+static void count_rows_taken(wcp)
 struct write_control * wcp;
-int mult;
-int count_flag;
+{
+struct piece * npp;
+int i;
+
+    for (i = 0; i < wcp->nshares; i++)
+        if (wcp->shares[i].per_trans > 0)
+            wcp->shares[i].per_trans = 1;
+    for (npp = wcp->script_file.content.piece_anchor;
+             npp != NULL;
+                 npp = npp->next_piece)
+        if (npp->kind == PIECE_SUB && npp->fresh)
+            bundle_share(wcp, npp->fcp->slot)->per_trans++;
+    return;
+}
+/*
+ * Go through the scripts of the bundles whose plans were not cached. The def
+ * file rows of all of them are resolved first, so that every mistake in them
+ * is reported before any script is scanned. Then the rows that each takes
+ * from each data file are known before any are read.
+ */
+static void scan_scripts(scp, wcps, nwc)
+struct scenario * scp;
+struct write_control ** wcps;
+int nwc;
 {
 int i;
-struct file_control * dfcp;
 
+    for (i = 0; i < nwc; i++)
+    {
+        if (wcps[i]->def_file.fname != NULL && wcps[i]->cache_ops == NULL)
+        {
+            resolve_def_rows(wcps[i], 1);
+            resolve_def_cols(wcps[i]);
+        }
+    }
+    for (i = 0; i < nwc; i++)
+    {
+        if (wcps[i]->cache_ops == NULL)
+        {
+            scan_script(wcps[i], wcps[i]->think_time_buf);
+            count_rows_taken(wcps[i]);
+        }
+    }
+    return;
+}
+/*
+ * Substitutions from a data file that turns out to have no rows to give are
+ * reported, once for the file, and the text is left alone.
+ */
+static void drop_empty_subs(wcp)
+struct write_control * wcp;
+{
+struct piece * npp;
+char * told;
+
+    told = (char *) calloc(wcp->scp->data_cnt + 1, sizeof(char));
+    for (npp = wcp->script_file.content.piece_anchor;
+             npp != NULL;
+                 npp = npp->next_piece)
+    {
+        if (npp->kind != PIECE_SUB
+          || (npp->fcp->slot < wcp->nshares
+           && wcp->shares[npp->fcp->slot].recs > 0))
+            continue;
+        if (!told[npp->fcp->slot])
+        {
+            told[npp->fcp->slot] = 1;
+            wcp->user_errors++;
+            fprintf(stderr, "User Error: data file %s cannot supply rows\n",
+                       npp->fcp->fname);
+        }
+        npp->kind = PIECE_TEXT;
+        npp->len = npp->match_len;
+    }
+    free(told);
+    return;
+}
+/*
+ * Complete the data structures that will drive the clone operation, once the
+ * data files have been read.
+ */
+static void assemble_clone_instructions(wcp, think_time_buf)
+struct write_control * wcp;
+char * think_time_buf;
+{
+/*
+ * Use the cached plan if there is one. If it can't be used after all, the def
+ * file has to be read, and the script gone through, now.
+ */
+    if (wcp->cache_ops != NULL)
+    {
+        if (pieces_from_cache(wcp, think_time_buf))
+        {
+            free(wcp->cache_ops);
+            wcp->cache_ops = NULL;
+            if (wcp->scp->verbose)
+                fprintf(stderr, "Bundle %s plan loaded from %s\n",
+                           wcp->bundle, wcp->cache_fname);
+            wcp->plan = compile_plan(wcp, think_time_buf);
+            return;
+        }
+        free(wcp->cache_ops);
+        wcp->cache_ops = NULL;
+        if (wcp->def_file.fname != NULL)
+        {
+            if (wcp->def_file.content.data.rows != NULL
+             || read_def(wcp))
+                resolve_def_rows(wcp, 0);
+            else
+            {
+                free(wcp->def_file.fname);
+                wcp->def_file.fname = NULL;
+            }
+        }
+    }
+    if (!wcp->scanned)
+        scan_script(wcp, think_time_buf);
+    drop_empty_subs(wcp);
+    if (wcp->cache_fname != NULL && wcp->user_errors == 0)
+        save_plan_cache(wcp, think_time_buf);
+    wcp->plan = compile_plan(wcp, think_time_buf);
+    return;
+}
+/******************************************************************************
+ * Data cursors
+ ******************************************************************************
+ * With -C, each data file has a cursor file alongside it (name.cur), giving
+ * where the next run is to start taking rows, and where the rows that may
+ * still be used begin:
+ *
+ * FASTCLONE CURSOR 1
+ * ring offset|line|offset|line|size|heading hash
+ *
+ * The lines are the numbers of the rows at the offsets, counting from 1 after
+ * the heading. When data can be re-used, the rows from the ring offset to the
+ * end of the file are a ring, and the next offset goes round it. Otherwise the
+ * rows taken are gone for good, as are any before them, so both offsets move
+ * on to the next row; this is what re-writing the data file would have done,
+ * except that rows re-used earlier are not kept for later re-use.
+ *
+ * The cursor is only good if the file has not shrunk and has the same heading;
+ * rows may be added to the end. The rows taken are recorded in the spent file
+ * (name.spent) as ranges, pid|first line|last line|offset|length.
+ */
+#define CURSOR_MAGIC "FASTCLONE CURSOR 1\n"
+static void load_cursor(scp, fcp)
+struct scenario * scp;
+struct file_control * fcp;
+{
+struct row_track * rtp = &(fcp->content.data);
+struct stat path_stat;
+struct file_stamp fs;
+char buf[256];
+char * fname;
+FILE * fp;
+long long ring_off;
+long long ring_line;
+long long off;
+long long line;
+long long size;
+unsigned long long hash;
+
+    rtp->start_off = 0;
+    rtp->start_line = 1;
+    rtp->ring_off = 0;
+    rtp->ring_line = 1;
+    rtp->wrap = scp->reuse_flag;
+    if (!strcmp(fcp->fname, "-"))
+        return;
+    fname = (char *) malloc(strlen(fcp->fname) + 5);
+    sprintf(fname, "%s.cur", fcp->fname);
+    if ((fp = fopen(fname, "rb")) == NULL)
+    {
+        free(fname);
+        return;
+    }
+    if (fgets(buf, sizeof(buf), fp) != NULL && !strcmp(buf, CURSOR_MAGIC)
+     && fgets(buf, sizeof(buf), fp) != NULL
+     && sscanf(buf, "%lld|%lld|%lld|%lld|%lld|%llx", &ring_off, &ring_line,
+                 &off, &line, &size, &hash) == 6
+     && stat(fcp->fname, &path_stat) == 0 && path_stat.st_size >= size
+     && file_stamp(fcp->fname, 1, NULL, 0, &fs) && fs.hash == hash)
+    {
+        rtp->ring_off = ring_off;
+        rtp->ring_line = ring_line;
+        rtp->start_off = off;
+        rtp->start_line = line;
+    }
+    else
+        fprintf(stderr,
+   "Cursor %s does not match %s; starting again from the first row\n",
+                 fname, fcp->fname);
+    fclose(fp);
+    free(fname);
+    return;
+}
+/*
+ * Record where the next run is to start, by writing a new cursor file and
+ * renaming it over the old one, so that the cursor is never half written.
+ */
+static int save_cursor(scp, fcp, fname)
+struct scenario * scp;
+struct file_control * fcp;
+char * fname;
+{
+struct row_index * ip = fcp->content.data.index;
+struct stat path_stat;
+struct file_stamp fs;
+char * tmp_fname;
+FILE * fp;
+int ret;
+
+    if (stat(fcp->fname, &path_stat) < 0
+     || !file_stamp(fcp->fname, 1, NULL, 0, &fs))
+    {
+        fprintf(stderr, "Cannot stamp %s for its cursor\n", fcp->fname);
+        perror("stat()");
+        return 0;
+    }
+    sprintf(fname, "%s.cur", fcp->fname);
+    tmp_fname = (char *) malloc(strlen(fname) + 24);
+    sprintf(tmp_fname, "%s.%d", fname, getpid());
+    if ((fp = fopen(tmp_fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", tmp_fname);
+        perror("fopen()");
+        free(tmp_fname);
+        return 0;
+    }
+    fputs(CURSOR_MAGIC, fp);
+    if (scp->reuse_flag)
+        fprintf(fp, "%lld|%lld|", ip->first_off, ip->first_line);
+    else
+        fprintf(fp, "%lld|%lld|", ip->rest_off, ip->rest_line);
+    fprintf(fp, "%lld|%lld|%lld|%llx\n", ip->rest_off, ip->rest_line,
+                (long long) path_stat.st_size, fs.hash);
+    if ((ret = (fclose(fp) == 0)))
+    {
+        if (rename(tmp_fname, fname) < 0)
+        {
+            fprintf(stderr, "Failed to rename %s to %s\n", tmp_fname, fname);
+            perror("rename()");
+            ret = 0;
+        }
+    }
+    else
+        perror("fclose()");
+    if (!ret)
+        unlink(tmp_fname);
+    free(tmp_fname);
+    return ret;
+}
+/*
+ * Record the rows taken from a data file, and move its cursor on. The work
+ * done depends only on the rows taken, not on the size of the file.
+ */
+static int advance_cursor(scp, fcp)
+struct scenario * scp;
+struct file_control * fcp;
+{
+struct row_index * ip = fcp->content.data.index;
+char * fname;
+FILE * fp;
+int ret;
+
+    fname = (char *) malloc(strlen(fcp->fname) + 7);
+    sprintf(fname, "%s.spent", fcp->fname);
+    if ((fp = fopen(fname, "ab")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for append\n", fname);
+        perror("fopen()");
+        free(fname);
+        return 0;
+    }
+    if (ip->end_line != 0)
+    {
+        if (ip->end_off > ip->start_off)
+            fprintf(fp, "%s|%lld|%lld|%lld|%lld\n", scp->pid,
+                ip->start_line, ip->end_line - 1,
+                ip->start_off, ip->end_off - ip->start_off);
+        if (ip->rest_off > ip->first_off)
+            fprintf(fp, "%s|%lld|%lld|%lld|%lld\n", scp->pid,
+                ip->first_line, ip->rest_line - 1,
+                ip->first_off, ip->rest_off - ip->first_off);
+    }
+    else
+        fprintf(fp, "%s|%lld|%lld|%lld|%lld\n", scp->pid,
+                ip->start_line, ip->rest_line - 1,
+                ip->start_off, ip->rest_off - ip->start_off);
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", fname);
+        perror("fclose()");
+        free(fname);
+        return 0;
+    }
+    ret = save_cursor(scp, fcp, fname);
+    free(fname);
+    return ret;
+}
+/******************************************************************************
+ * Data file locks
+ ******************************************************************************
+ * Several fastclone processes may be cloning from the same data files at the
+ * same time. Each data file has a lock file next to it (name.lock), which is
+ * locked while the file is being read and moved on. The lock file, unlike the
+ * data file, is never replaced, so it is always the same file that is locked.
+ *
+ * With -C, claiming rows just means reading the cursor, indexing the rows and
+ * writing the cursor back; the lock is only held for that long, and the
+ * processes can then write their scripts in parallel, each with its own rows.
+ *
+ * Otherwise, the data file is only moved on when it is re-written at the end,
+ * so the locks are held from before the files are read until they have been
+ * re-written. They are taken in order of file name, so that processes cannot
+ * each be waiting for a lock the other holds.
+ *
+ * The locks are only taken on Linux; elsewhere, runs must not overlap.
+ */
+static void lock_data_file(scp, fcp)
+struct scenario * scp;
+struct file_control * fcp;
+{
+#ifdef LINUX
+char * fname;
+int fd;
+
+    if (!strcmp(fcp->fname, "-"))
+        return;
+    if (scp->locks == NULL)
+    {
+        scp->locks = (int *) malloc(sizeof(int) * (scp->data_cnt + 1));
+        for (fd = 0; fd <= scp->data_cnt; fd++)
+            scp->locks[fd] = -1;
+    }
+    fname = (char *) malloc(strlen(fcp->fname) + 6);
+    sprintf(fname, "%s.lock", fcp->fname);
+    if ((fd = open(fname, O_RDWR | O_CREAT, 0666)) < 0)
+    {
+        fprintf(stderr, "Failed to open lock file %s; %s is not locked\n",
+                  fname, fcp->fname);
+        perror("open()");
+        free(fname);
+        return;
+    }
+    while (flock(fd, LOCK_EX) < 0)
+    {
+        if (errno == EINTR)
+            continue;
+        fprintf(stderr, "Failed to lock %s; %s is not locked\n",
+                  fname, fcp->fname);
+        perror("flock()");
+        close(fd);
+        free(fname);
+        return;
+    }
+    scp->locks[fcp->slot] = fd;
+    free(fname);
+#endif
+    return;
+}
+static void unlock_data_file(scp, fcp)
+struct scenario * scp;
+struct file_control * fcp;
+{
+#ifdef LINUX
+    if (scp->locks != NULL && scp->locks[fcp->slot] >= 0)
+    {
+        close(scp->locks[fcp->slot]);   /* Closing releases the lock */
+        scp->locks[fcp->slot] = -1;
+    }
+#endif
+    return;
+}
+static int fname_comp(p1, p2)
+struct file_control ** p1;
+struct file_control ** p2;
+{
+    return strcmp((*p1)->fname, (*p2)->fname);
+}
+/*
+ * Lock all the data files, in order of name
+ */
+static void lock_data_files(scp)
+struct scenario * scp;
+{
+struct file_control ** fcpp;
+struct file_control * fcp;
+int n;
+int i;
+
+    if (scp->data_cnt < 1)
+        return;
+    fcpp = (struct file_control **) malloc(sizeof(struct file_control *) *
+                          scp->data_cnt);
+    for (n = 0, fcp = scp->data_anchor;
+            fcp != NULL && n < scp->data_cnt;
+                fcp = fcp->next_file)
+        fcpp[n++] = fcp;
+    qsort(fcpp, n, sizeof(struct file_control *), fname_comp);
+    for (i = 0; i < n; i++)
+        lock_data_file(scp, fcpp[i]);
+    free(fcpp);
+    return;
+}
+/*
+ * Work out how many rows the bundles need from a data file
+ */
+static long long rows_wanted(dfcp, wcps, nwc)
+struct file_control * dfcp;
+struct write_control ** wcps;
+int nwc;
+{
+long long want;
+int b;
+
+    for (want = 0, b = 0; b < nwc; b++)
+        if (dfcp->slot < wcps[b]->nshares)
+            want += ((long long) wcps[b]->shares[dfcp->slot].per_trans) *
+                          wcps[b]->nusers * wcps[b]->ntrans;
+    return want;
+}
+/*
+ * What indexing a row with cols columns costs; see struct row_index.
+ */
+#define ROW_COST(cols) ((long long) (2 * sizeof(unsigned char *) +\
+                          sizeof(unsigned int) * ((cols) + 2)))
+/*
+ * With -C, record the rows taken from a data file, and let it go.
+ */
+static void claim_rows(scp, dfcp)
+struct scenario * scp;
+struct file_control * dfcp;
+{
+    if (scp->cursor_flag)
+    {
+        if (dfcp->content.data.recs > 0 && strcmp(dfcp->fname, "-"))
+            advance_cursor(scp, dfcp);
+        unlock_data_file(scp, dfcp);
+    }
+    return;
+}
+/*
+ * With the rows each bundle takes from each data file known (see
+ * scan_scripts()), work out how many records we are going to need from each,
+ * and read them unless all we are doing is counting our requirement.
+ *
+ * Each data file is read once for all the bundles, and each bundle is given
+ * its own range of the rows read. If a file cannot supply all the rows asked
+ * for, the rows it has are shared out in proportion, and a bundle whose share
+ * comes to nothing gets to use all of them, as it would if cloned on its own.
+ *
+ * With -M, a file that could be worked through in windows isn't indexed until
+ * we know whether the indexes would take more than we are allowed. If they
+ * would, the windows are moved on by do_the_clone(), and the rows are only
+ * claimed (with -C) or tidied once all the bundles are done. Such a file has
+ * to be mapped, and have every row asked for, since nothing is shared out.
+ */
+static void collect_needed_data(scp, wcps, nwc)
+struct scenario * scp;
+struct write_control ** wcps;
+int nwc;
+{
+int b;
+long long want;
+long long sofar;
+long long need;
+long long fixed;
+long long wcost;
+struct file_control * dfcp;
+struct data_share * dsp;
+
+/*
+ * Read in the data files chained to the scenario, and share them out.
+ * With -C the rows are claimed a file at a time; otherwise the files stay
+ * locked until they have been re-written. A file that may be windowed may
+ * stay locked, so with -M all the locks are taken in order, as they are
+ * without -C.
+ */
+    if (scp->windowed != NULL)
+    {
+        free(scp->windowed);
+        scp->windowed = NULL;
+    }
+    if (scp->count_flag)
+    {
+        for (dfcp = scp->data_anchor; dfcp != NULL; dfcp = dfcp->next_file)
+        {
+            want = rows_wanted(dfcp, wcps, nwc);
+            dfcp->content.data.recs = (want > 0x7fffffffL) ? 0x7fffffff :
+                                       (int) want;
+        }
+        return;
+    }
+    if (!scp->cursor_flag || scp->max_mem > 0)
+        lock_data_files(scp);
+    if (scp->max_mem > 0)
+        scp->windowed = (char *) calloc(scp->data_cnt + 1, sizeof(char));
+    for (fixed = 0, wcost = 0, dfcp = scp->data_anchor;
+             dfcp != NULL;
+                 dfcp = dfcp->next_file)
+    {
+        want = rows_wanted(dfcp, wcps, nwc);
+        dfcp->content.data.recs = (want > 0x7fffffffL) ? 0x7fffffff :
+                                   (int) want;
+        if (scp->cursor_flag)
+        {
+            if (scp->max_mem <= 0)
+                lock_data_file(scp, dfcp);
+            load_cursor(scp, dfcp);
+        }
+        if (scp->windowed != NULL && want > 0 && want <= 0x7fffffffL
+         && get_data_window(dfcp, 0)
+         && data_lines_ahead(dfcp, want) >= want)
+        {
+            scp->windowed[dfcp->slot] = 1;
+            wcost += want * ROW_COST(dfcp->content.data.index->cols);
+            continue;
+        }
+        if (dfcp->content.data.index != NULL)
+        {                             /* Mapped, but too short for windows */
+            get_data_window(dfcp, dfcp->content.data.recs);
+            dfcp->content.data.recs = dfcp->content.data.index->recs;
+        }
+        else
+            get_data_index(dfcp);
+        if (dfcp->content.data.index != NULL)
+            fixed += dfcp->content.data.index->recs *
+                          ROW_COST(dfcp->content.data.index->cols);
+        claim_rows(scp, dfcp);
+    }
+/*
+ * If the files that could be windowed fit after all, index them in full
+ */
+    if (scp->windowed != NULL && wcost > 0)
+    {
+        scp->window_mem = scp->max_mem - fixed;
+        if (wcost <= scp->window_mem)
+        {
+            for (dfcp = scp->data_anchor;
+                     dfcp != NULL;
+                         dfcp = dfcp->next_file)
+            {
+                if (!scp->windowed[dfcp->slot])
+                    continue;
+                scp->windowed[dfcp->slot] = 0;
+                get_data_window(dfcp, dfcp->content.data.recs);
+                dfcp->content.data.recs = dfcp->content.data.index->recs;
+                claim_rows(scp, dfcp);
+            }
+        }
+        else
+        if (scp->verbose)
+            fprintf(stderr,
+"Data file indexes would take %lld bytes, with %lld allowed; using windows\n",
+                       wcost + fixed, scp->max_mem);
+    }
+    for (dfcp = scp->data_anchor;
+             dfcp != NULL;
+                 dfcp = dfcp->next_file)
+    {
+        want = rows_wanted(dfcp, wcps, nwc);
+        for (sofar = 0, b = 0; b < nwc; b++)
+        {
+            if (dfcp->slot >= wcps[b]->nshares
+             || wcps[b]->shares[dfcp->slot].per_trans == 0)
+                continue;
+            dsp = &wcps[b]->shares[dfcp->slot];
+            need = ((long long) dsp->per_trans) * wcps[b]->nusers *
+                                  wcps[b]->ntrans;
+            dsp->first = (int) ((sofar * dfcp->content.data.recs) / want);
+            sofar += need;
+            dsp->recs = (int) ((sofar * dfcp->content.data.recs) / want) -
+                             dsp->first;
+            if (dsp->recs < 1)
+            {
+                dsp->first = 0;
+                dsp->recs = dfcp->content.data.recs;
+            }
+        }
+    }
+    return;
+}
+#ifdef LINUX
+/*
+ * Scatter-gather output. Short items are copied in to a large buffer, which
+ * is written out together with direct references to the long items using
+ * writev(). Everything the plan points at stays put for the life of the clone,
+ * so the references remain good until the next flush.
+ */
+#define OUT_IOV    1024
+#define OUT_BUF    (1024 * 1024)
+#define OUT_DIRECT 256
+struct out_vec {
+    int fd;
+    int niov;
+    unsigned int used;
+    unsigned char * buf;
+    struct iovec iov[OUT_IOV];
+};
+static struct out_vec * out_vec_new()
+{
+struct out_vec * ovp = (struct out_vec *) malloc(sizeof(struct out_vec));
+
+    ovp->fd = -1;
+    ovp->niov = 0;
+    ovp->used = 0;
+    ovp->buf = (unsigned char *) malloc(OUT_BUF);
+    return ovp;
+}
+/*
+ * Write out everything collected so far, allowing for short writes
+ */
+static int out_vec_flush(ovp)
+struct out_vec * ovp;
+{
+struct iovec * iovp = &ovp->iov[0];
+int niov = ovp->niov;
+ssize_t len;
+
+    while (niov > 0)
+    {
+        if ((len = writev(ovp->fd, iovp, niov)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("writev()");
+            break;
+        }
+        while (niov > 0 && len >= iovp->iov_len)
+        {
+            len -= iovp->iov_len;
+            iovp++;
+            niov--;
+        }
+        if (niov > 0)
+        {
+            iovp->iov_base = ((char *) iovp->iov_base) + len;
+            iovp->iov_len -= len;
+        }
+    }
+    ovp->niov = 0;
+    ovp->used = 0;
+    return (niov == 0);
+}
+static void out_vec_put(ovp, p, len)
+struct out_vec * ovp;
+char * p;
+unsigned long len;
+{
+struct iovec * iovp;
+
+    if (len == 0)
+        return;
+    if (ovp->niov >= OUT_IOV
+      || (len < OUT_DIRECT && ovp->used + len > OUT_BUF))
+        out_vec_flush(ovp);
+    iovp = &ovp->iov[ovp->niov];
+    if (len >= OUT_DIRECT)
+    {
+        iovp->iov_base = p;
+        iovp->iov_len = len;
+        ovp->niov++;
+        return;
+    }
+    memcpy(ovp->buf + ovp->used, p, len);
+/*
+ * Extend the previous reference if it ends where we have just copied to
+ */
+    if (ovp->niov > 0
+      && ((unsigned char *) (iovp - 1)->iov_base) + (iovp - 1)->iov_len ==
+              ovp->buf + ovp->used)
+        (iovp - 1)->iov_len += len;
+    else
+    {
+        iovp->iov_base = ovp->buf + ovp->used;
+        iovp->iov_len = len;
+        ovp->niov++;
+    }
+    ovp->used += len;
+    return;
+}
+static void out_vec_free(ovp)
+struct out_vec * ovp;
+{
+    free(ovp->buf);
+    free(ovp);
+    return;
+}
+/*
+ * With -P, the script text is copied in to buffers from the pipe, which are
+ * handed over to the writers as they fill.
+ */
+struct pipe_out {
+    struct fc_pipe * pp;
+    struct fcp_file * fop;
+    struct fcp_buf * bp;
+    long long off;              /* Where the current buffer goes            */
+};
+static void pipe_put(pop, p, len)
+struct pipe_out * pop;
+char * p;
+unsigned long len;
+{
+struct fcp_buf * bp = pop->bp;
+unsigned long n;
+
+    while (len > 0)
+    {
+        if ((n = pop->pp->buf_size - bp->len) > len)
+            n = len;
+        memcpy(bp->data + bp->len, p, n);
+        bp->len += n;
+        p += n;
+        len -= n;
+        if (bp->len >= pop->pp->buf_size)
+        {
+            pop->off += bp->len;         /* It is not ours once handed over */
+            fcp_put(pop->pp, bp);
+            bp = fcp_get(pop->pp, pop->fop, pop->off);
+            pop->bp = bp;
+        }
+    }
+    return;
+}
+#endif
+/*
+ * Control structure shared by the threads writing out the scripts.
+ */
+struct clone_job {
+    struct write_control * wcp;
+    char * pid;
+    char * bundle;
+    int nusers;                 /* The user to stop at                       */
+    int ntrans;
+    int next_user;              /* Next user to be allocated to a thread     */
+    unsigned long long bytes;   /* Bytes written so far                      */
+    int fixed;                  /* Whether the values are made the length    */
+    unsigned long user_size;    /* of what they replace, and so this is the  */
+                                /* size of every user's script               */
+    struct fc_archive * archive; /* Where the scripts go, with -A            */
+#ifdef LINUX
+    struct fc_pipe * pipe;      /* What writes the scripts, with -P          */
+    pthread_mutex_t guard;
+#endif
+};
+/*
+ * With -A, a user's script is built up in memory, and goes in to the archive
+ * in one piece when it is complete.
+ *
+ * When the values are fixed length, every user's script is the same, known,
+ * size. If it isn't going in to an archive or through the pipeline, the file
+ * is made that size up front and mapped, and the script is built up straight
+ * in the mapping. Where there is no mmap(), it is built up in a buffer of
+ * that size and written in one go.
+ */
+struct mem_out {
+    unsigned char * buf;
+    unsigned long len;
+    unsigned long alloc;
+    int fd;                     /* The file mapped, or -1                    */
+};
+static void mem_put(mop, p, len)
+struct mem_out * mop;
+char * p;
+unsigned long len;
+{
+    if (mop->len + len > mop->alloc)
+    {
+        if (mop->fd >= 0)
+            len = mop->alloc - mop->len;   /* A mapping cannot grow */
+        else
+        {
+            for (mop->alloc = (mop->alloc < 65536) ? 65536 : mop->alloc;
+                    mop->len + len > mop->alloc;
+                        mop->alloc += mop->alloc);
+            mop->buf = (unsigned char *) realloc(mop->buf, mop->alloc);
+        }
+    }
+    memcpy(mop->buf + mop->len, p, len);
+    mop->len += len;
+    return;
+}
+/*
+ * Start building up a user's script in memory. If it is to go to the file
+ * fname, and is of a known size, the file is made that size and mapped.
+ * Returns 0 if the file cannot be set up.
+ */
+static int mem_out_start(mop, fname, size)
+struct mem_out * mop;
+char * fname;
+unsigned long size;
+{
+#ifdef LINUX
+int ret;
+#endif
+
+    mop->len = 0;
+    mop->fd = -1;
+#ifdef LINUX
+    if (fname != NULL && size > 0)
+    {
+        if ((mop->fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+        {
+            fprintf(stderr, "Failed to open %s for write\n", fname);
+            perror("open()");
+            return 0;
+        }
+/*
+ * The space is allocated rather than the file just being extended, so that
+ * running out of it is found out now, rather than with a SIGBUS later.
+ */
+        if ((ret = posix_fallocate(mop->fd, 0, (off_t) size)) != 0
+          || (mop->buf = (unsigned char *) mmap(NULL, size,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, mop->fd, 0))
+                         == (unsigned char *) MAP_FAILED)
+        {
+            if (ret != 0)
+                errno = ret;
+            fprintf(stderr, "Failed to set up %lu bytes for %s\n", size,
+                        fname);
+            perror((ret != 0) ? "posix_fallocate()" : "mmap()");
+            close(mop->fd);
+            mop->fd = -1;
+            mop->buf = NULL;
+            return 0;
+        }
+        mop->alloc = size;
+        return 1;
+    }
+#endif
+    if (size > mop->alloc)
+    {
+        mop->alloc = size;
+        mop->buf = (unsigned char *) realloc(mop->buf, mop->alloc);
+    }
+    return 1;
+}
+/*
+ * Finish off a script built up in memory for the file fname. Returns 0 if it
+ * could not be written.
+ */
+static int mem_out_finish(mop, fname)
+struct mem_out * mop;
+char * fname;
+{
+FILE * ofp;
+int ret = 1;
+
+#ifdef LINUX
+    if (mop->fd >= 0)
+    {
+        if ((mop->len < mop->alloc && ftruncate(mop->fd, (off_t) mop->len) < 0)
+          || munmap(mop->buf, mop->alloc) < 0 || close(mop->fd) < 0)
+        {
+            fprintf(stderr, "Failed to write %s\n", fname);
+            perror("munmap()");
+            ret = 0;
+        }
+        mop->buf = NULL;
+        mop->alloc = 0;
+        mop->fd = -1;
+        return ret;
+    }
+#endif
+    if ((ofp = fopen(fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("fopen()");
+        return 0;
+    }
+    if (fwrite(mop->buf, sizeof(char), mop->len, ofp) != mop->len)
+        ret = 0;
+    if (fclose(ofp) != 0)
+        ret = 0;
+    if (!ret)
+    {
+        fprintf(stderr, "Failed to write %s\n", fname);
+        perror("fwrite()");
+    }
+    return ret;
+}
+/*
+ * Put some of a user's script wherever it is going
+ */
+static void user_put(ofp, ovp, mop, pop, p, len)
+FILE * ofp;
+void * ovp;
+struct mem_out * mop;
+void * pop;
+char * p;
+unsigned long len;
+{
+    if (mop != NULL)
+        mem_put(mop, p, len);
+    else
+#ifdef LINUX
+    if (pop != NULL)
+        pipe_put((struct pipe_out *) pop, p, len);
+    else
+    if (ovp != NULL)
+        out_vec_put((struct out_vec *) ovp, p, len);
+    else
+#endif
+        fwrite(p, sizeof(char), len, ofp);
+    return;
+}
+/*
+ * Write out the script for one user. The starting row in each data file
+ * follows from the user number and the rows a transaction takes from it, so
+ * the users can be written in any order and still get the same data.
+ *
+ * If the values are to be fixed length, each is cut short or padded out with
+ * spaces to the length of the text it replaces, and a value that cannot be
+ * had is all spaces.
+ *
+ * Returns the number of bytes written.
+ */
+static unsigned long long clone_one_user(cjp, user, fname, cur_rows, ovp,
+                                         mop, pop)
+struct clone_job * cjp;
+int user;
+char * fname;
+int * cur_rows;
+void * ovp;
+struct mem_out * mop;
+void * pop;
+{
+struct clone_plan * cpp = cjp->wcp->plan;
+struct plan_op * op;
+struct plan_op * eop = cpp->ops + cpp->nops;
+struct plan_src * srcp;
+struct row_index * ip;
+FILE * ofp;
+char * p;
+unsigned long len;
+unsigned long pad;
+unsigned long long bytes;
+int * cur_row;
+int r;
+int i;
+int j;
+static char blanks[] = "                                                ";
+FCT_DECL(t0)
+
+    FCT_START(t0);
+    sprintf(fname, "echo%s.%s.%d", cjp->pid, cjp->bundle, user);
+    if (mop != NULL)
+    {
+        ofp = NULL;
+        if (!mem_out_start(mop, (cjp->archive == NULL) ? fname : NULL,
+                    (cjp->fixed) ? cjp->user_size : 0))
+            return 0;
+    }
+    else
+#ifdef LINUX
+    if (pop != NULL)
+    {
+        ofp = NULL;
+        if ((((struct pipe_out *) pop)->fop = fcp_open(
+                       ((struct pipe_out *) pop)->pp, fname)) == NULL)
+            return 0;
+        ((struct pipe_out *) pop)->off = 0;
+        ((struct pipe_out *) pop)->bp = fcp_get(((struct pipe_out *) pop)->pp,
+                               ((struct pipe_out *) pop)->fop, 0);
+    }
+    else
+    if (ovp != NULL)
+    {
+        ofp = NULL;
+        if ((((struct out_vec *) ovp)->fd = open(fname,
+                       O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        {
+            fprintf(stderr, "Failed to open %s for write\n", fname);
+            perror("open()");
+            return 0;
+        }
+    }
+    else
+#endif
+    if ((ofp = fopen(fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("fopen()");
+        return 0;
+    }
+    FCT_SPAN("open", fname, user, t0);
+    for (i = 0, srcp = cpp->srcs; i < cpp->nsrcs; i++, srcp++)
+    {
+        if (srcp->recs > 0)
+            cur_rows[i] = srcp->first + (int) (((long long) user *
+                        cjp->ntrans * cpp->cons[i]) % srcp->recs);
+        else
+            cur_rows[i] = srcp->first;
+    }
+    for (bytes = 0, j = 0; j < cjp->ntrans; j++)
+    {
+        for (op = cpp->ops; op < eop; op++)
+        {
+            pad = 0;
+            if (op->op != PLAN_COL)
+            {
+                p = op->p;
+                len = op->len;
+            }
+            else
+            {
+                srcp = &cpp->srcs[op->slot];
+                cur_row = &cur_rows[op->slot];
+                if (op->fresh && ++(*cur_row) >= srcp->first + srcp->recs)
+                    *cur_row = srcp->first;
+                p = blanks;
+                len = 0;
+                if (op->col >= 0 && (ip = srcp->index)->recs > 0)
+                {
+                    if ((r = *cur_row - srcp->row0) < 0 || r >= ip->recs)
+                    {                    /* The window doesn't hold it */
+                        if ((r %= ip->recs) < 0)
+                            r += ip->recs;
+                    }
+                    p = (char *) IDX_COL(ip, r, op->col);
+                    len = IDX_COL_LEN(ip, r, op->col);
+                }
+                if (cjp->fixed)
+                {
+                    if (len > op->len)
+                        len = op->len;
+                    pad = op->len - len;
+                }
+            }
+            user_put(ofp, ovp, mop, pop, p, len);
+            bytes += len;
+            for (; pad > 0; pad -= len)
+            {
+                len = (pad < sizeof(blanks) - 1) ? pad : sizeof(blanks) - 1;
+                user_put(ofp, ovp, mop, pop, blanks, len);
+                bytes += len;
+            }
+        }
+/*
+ * Bump on all the data files
+ */
+        for (i = 0, srcp = cpp->srcs; i < cpp->nsrcs; i++, srcp++)
+            if (++cur_rows[i] >= srcp->first + srcp->recs)
+                cur_rows[i] = srcp->first;
+    }
+    if (mop != NULL)
+    {
+        if (cjp->archive != NULL)
+        {
+            if (!fca_put(cjp->archive, user, mop->buf, mop->len))
+                return 0;
+        }
+        else
+        if (!mem_out_finish(mop, fname))
+            return 0;
+    }
+    else
+#ifdef LINUX
+    if (pop != NULL)
+    {
+        fcp_put(((struct pipe_out *) pop)->pp, ((struct pipe_out *) pop)->bp);
+        fcp_close(((struct pipe_out *) pop)->pp,
+                  ((struct pipe_out *) pop)->fop);
+    }
+    else
+    if (ovp != NULL)
+    {
+        out_vec_flush((struct out_vec *) ovp);
+        close(((struct out_vec *) ovp)->fd);
+    }
+    else
+#endif
+        fclose(ofp);
+    FCT_SPAN("render", fname, bytes, t0);
+    return bytes;
+}
+/*
+ * Take users off the job until there are none left
+ */
+static void * clone_worker(arg)
+void * arg;
+{
+struct clone_job * cjp = (struct clone_job *) arg;
+char * fname;
+int * cur_rows;
+void * ovp;
+struct mem_out * mop;
+void * pop;
+unsigned long long bytes;
+int user;
+
+    fname = (char *) malloc(strlen(cjp->pid) + strlen(cjp->bundle) + 20);
+    cur_rows = (int *) malloc(sizeof(int) * (cjp->wcp->scp->data_cnt + 1));
+    mop = NULL;
+    pop = NULL;
+#ifdef LINUX
+    if (cjp->pipe != NULL)
+    {
+        pop = calloc(1, sizeof(struct pipe_out));
+        ((struct pipe_out *) pop)->pp = cjp->pipe;
+    }
+#endif
+    if (cjp->archive != NULL || (cjp->fixed && pop == NULL))
+    {
+        mop = (struct mem_out *) calloc(1, sizeof(struct mem_out));
+        mop->fd = -1;
+    }
+#ifdef LINUX
+    if (mop == NULL && pop == NULL && cjp->wcp->scp->out_mode == OUT_WRITEV)
+        ovp = (void *) out_vec_new();
+    else
+#endif
+        ovp = NULL;
+    for (bytes = 0;;)
+    {
+#ifdef LINUX
+        pthread_mutex_lock(&cjp->guard);
+#endif
+        user = cjp->next_user++;
+        cjp->bytes += bytes;
+#ifdef LINUX
+        pthread_mutex_unlock(&cjp->guard);
+#endif
+        if (user >= cjp->nusers)
+            break;
+        bytes = clone_one_user(cjp, user, fname, cur_rows, ovp, mop, pop);
+    }
+#ifdef LINUX
+    if (ovp != NULL)
+        out_vec_free((struct out_vec *) ovp);
+    if (pop != NULL)
+        free(pop);
+#endif
+    if (mop != NULL)
+    {
+        free(mop->buf);
+        free(mop);
+    }
+    free(fname);
+    free(cur_rows);
+    return NULL;
+}
+/*
+ * Write the scripts for the users the job has, sharing them out between the
+ * threads if there is more than one.
+ */
+static void run_clone_job(cjp, nthreads)
+struct clone_job * cjp;
+int nthreads;
+{
+#ifdef LINUX
+pthread_t * tids;
+int i;
+
+    if (nthreads > 1 && cjp->nusers - cjp->next_user > 1)
+    {
+        if (nthreads > cjp->nusers - cjp->next_user)
+            nthreads = cjp->nusers - cjp->next_user;
+        pthread_mutex_init(&cjp->guard, NULL);
+        tids = (pthread_t *) malloc(sizeof(pthread_t) * nthreads);
+        for (i = 0; i < nthreads; i++)
+            if (pthread_create(&tids[i], NULL, clone_worker, cjp))
+            {
+                perror("pthread_create()");
+                break;
+            }
+/*
+ * If no threads could be started at all, we do the work ourselves.
+ */
+        if (i == 0)
+            clone_worker(cjp);
+        while (i > 0)
+            pthread_join(tids[--i], NULL);
+        pthread_mutex_destroy(&cjp->guard);
+        free(tids);
+    }
+    else
+    {
+        pthread_mutex_init(&cjp->guard, NULL);
+        clone_worker(cjp);
+        pthread_mutex_destroy(&cjp->guard);
+    }
+#else
+    clone_worker(cjp);
+#endif
+    return;
+}
+/*
+ * What a user of a bundle costs in the windows on the data files. The rows a
+ * transaction takes are the ones the plan takes, since that is how the users
+ * are placed.
+ */
+static long long window_cost(wcp)
+struct write_control * wcp;
+{
+struct scenario * scp = wcp->scp;
+struct file_control * dfcp;
+long long cost;
+
+    if (scp->windowed == NULL)
+        return 0;
+    for (cost = 0, dfcp = scp->data_anchor;
+             dfcp != NULL;
+                 dfcp = dfcp->next_file)
+        if (scp->windowed[dfcp->slot] && dfcp->slot < wcp->plan->nsrcs)
+            cost += ((long long) wcp->plan->cons[dfcp->slot]) *
+                      wcp->ntrans * ROW_COST(dfcp->content.data.index->cols);
+    return cost;
+}
+/*
+ * Move the windows on to the rows that the next nusers users of a bundle take
+ */
+static void next_windows(wcp, nusers)
+struct write_control * wcp;
+int nusers;
+{
+struct scenario * scp = wcp->scp;
+struct file_control * dfcp;
+struct row_index * ip;
+long long want;
+
+    for (dfcp = scp->data_anchor; dfcp != NULL; dfcp = dfcp->next_file)
+    {
+        if (!scp->windowed[dfcp->slot] || dfcp->slot >= wcp->plan->nsrcs
+         || wcp->plan->cons[dfcp->slot] == 0)
+            continue;
+        want = ((long long) wcp->plan->cons[dfcp->slot]) *
+                      wcp->ntrans * nusers;
+        get_data_window(dfcp, (int) want);
+        ip = dfcp->content.data.index;
+        wcp->plan->srcs[dfcp->slot].row0 = ip->row0;
+        if (ip->recs < want)
+            fprintf(stderr,
+                "Only found %d of the next %lld rows wanted from %s\n",
+                     ip->recs, want, dfcp->fname);
+    }
+    return;
+}
+/*
+ * Actually generate the output scripts; nusers files with ntrans transactions
+ * in each. With more than one thread, the users are shared out between them.
+ * Returns the number of bytes written.
+ *
+ * If some of the data files are being worked through in windows, the users
+ * are done in batches, as many at a time as the windows for them will fit in
+ * the memory left for them.
+ */
+static unsigned long long do_the_clone(wcp)
+struct write_control * wcp;
+{
+struct clone_job cj;
+struct plan_op * op;
+char * fname;
+long long cost;
+int batch;
+int cols;
+double started;
+double elapsed;
+#ifdef LINUX
+struct fcp_stats ps;
+#endif
+
+    cj.wcp = wcp;
+    cj.pid = wcp->scp->pid;
+    cj.bundle = wcp->bundle;
+    cj.ntrans = wcp->ntrans;
+    cj.bytes = 0;
+    cj.archive = NULL;
+/*
+ * With fixed length substitutions every script is the same size, known now
+ */
+    cj.fixed = !wcp->var_flag;
+    for (cols = 0, cj.user_size = 0, op = wcp->plan->ops;
+             op < wcp->plan->ops + wcp->plan->nops; op++)
+    {
+        if (op->op == PLAN_COL && op->col >= 0)
+            cols++;
+        cj.user_size += op->len;
+    }
+    cj.user_size *= wcp->ntrans;
+    if (wcp->scp->archive_flag)
+    {
+        fname = (char *) malloc(strlen(cj.pid) + strlen(cj.bundle) + 10);
+        sprintf(fname, "echo%s.%s.fca", cj.pid, cj.bundle);
+        cj.archive = fca_create(fname, wcp->nusers);
+        free(fname);
+        if (cj.archive == NULL)
+            return 0;
+    }
+    batch = wcp->nusers;
+    if ((cost = window_cost(wcp)) > 0)
+    {
+        if (wcp->scp->window_mem / cost < batch)
+            batch = (wcp->scp->window_mem / cost < 1) ? 1 :
+                          (int) (wcp->scp->window_mem / cost);
+        if (wcp->scp->verbose)
+            fprintf(stderr, "Bundle %s: %d users at a time\n",
+                           wcp->bundle, batch);
+    }
+    started = fc_now();
+#ifdef LINUX
+    cj.pipe = NULL;
+    if (wcp->scp->pipe_writers > 0 && cj.archive == NULL)
+        cj.pipe = fcp_new(wcp->scp->pipe_writers, wcp->scp->pipe_depth,
+                          OUT_BUF, wcp->scp->nthreads);
+#endif
+    for (cj.nusers = 0; cj.nusers < wcp->nusers;)
+    {
+        cj.next_user = cj.nusers;
+        cj.nusers = (wcp->nusers - cj.nusers > batch) ? cj.nusers + batch :
+                         wcp->nusers;
+        if (cost > 0)
+            next_windows(wcp, cj.nusers - cj.next_user);
+        run_clone_job(&cj, wcp->scp->nthreads);
+    }
+    if (cj.archive != NULL)
+        fca_close(cj.archive);
+#ifdef LINUX
+    if (cj.pipe != NULL)
+    {
+        fcp_finish(cj.pipe, &ps);
+        if (ps.errors > 0)
+        {
+            fprintf(stderr, "Bundle %s: %d pipeline write errors\n",
+                       wcp->bundle, ps.errors);
+            wcp->scp->write_errors += ps.errors;
+        }
+    }
+#endif
+    wcp->scp->stats.bundles++;
+    wcp->scp->stats.users += wcp->nusers;
+    wcp->scp->stats.subs += ((long long) cols) * wcp->ntrans * wcp->nusers;
+    wcp->scp->stats.bytes_written += cj.bytes;
+    if (wcp->scp->verbose)
+    {
+        elapsed = fc_now() - started;
+        fprintf(stderr,
+             "Wrote %llu bytes to %d scripts in %.3f seconds (%.2f MB/s) with %s\n",
+               cj.bytes, wcp->nusers, elapsed,
+               (elapsed > 0.0) ? ((double) cj.bytes)/(1048576.0 * elapsed) : 0.0,
+               (wcp->scp->archive_flag) ? "an archive" :
+#ifdef LINUX
+               (cj.pipe != NULL) ? "a pipeline" :
+#endif
+               (cj.fixed) ? "fixed length files" :
+               (wcp->scp->out_mode == OUT_WRITEV) ? "writev()" : "stdio");
+#ifdef LINUX
+        if (cj.pipe != NULL)
+            fprintf(stderr,
+"Pipeline: %d writers (%d with io_uring), depth %d; %lld buffers written\n\
+Buffers waiting: %.1f on average, %d at most; %d writes in flight at most\n\
+Renderers stalled %.3f seconds; writers idle %.3f seconds; %d write errors\n",
+                wcp->scp->pipe_writers, ps.uring, wcp->scp->pipe_depth,
+                ps.bufs, (ps.bufs > 0) ? ((double) ps.queued_sum)/ps.bufs : 0.0,
+                ps.queued_max, ps.inflight_max, ps.render_stall,
+                ps.writer_idle, ps.errors);
+#endif
+    }
+    return cj.bytes;
+}
+#ifndef FC_BENCH
+/*
+ * Count the data file rows taken, and the text they came from. A windowed
+ * file has its last window, and row0 rows before it.
+ */
+static void data_stats(scp)
+struct scenario * scp;
+{
+struct file_control * fcp;
+struct row_index * ip;
+
+    for (fcp = scp->data_anchor; fcp != NULL; fcp = fcp->next_file)
+    {
+        if ((ip = fcp->content.data.index) == NULL)
+            continue;
+        scp->stats.rows_parsed += ip->row0 + ip->recs;
+        if (ip->end_line != 0)
+            scp->stats.bytes_read += (ip->end_off - ip->start_off) +
+                                     (ip->rest_off - ip->first_off);
+        else
+            scp->stats.bytes_read += ip->rest_off - ip->start_off;
+    }
+    return;
+}
+#endif
+/******************************************************************************
+ * Tidy up the data files used to feed the merge
+ ******************************************************************************
+ * Loop through the data file chain. For each data file used:
+ * -    We add any data we have taken to the spent file.
+ * -    We write out the rest of the data file to a new version of same
+ * -    If we are re-using data, we add our used data to the end of each file
+ *
+ * The rest of the data file is usually by far the biggest part. Where we can,
+ * we have the kernel copy it, so that it never comes up in to user space, and
+ * the file system can share the blocks rather than copying them.
+ */
+struct tidy_stats {
+    int files;
+    long long written;          /* Bytes written by us                  */
+    long long avoided;          /* Bytes copied by the kernel instead   */
+};
+#ifdef LINUX
+/*
+ * Have the kernel copy from one file to the end of another. copy_file_range()
+ * reflinks where the file system supports it; sendfile() is tried if it is not
+ * available or will not copy between these files. Returns the number of bytes
+ * moved; the caller must deal with any that are left.
+ */
+static long long kernel_copy(ofd, ifd, off, end)
+int ofd;
+int ifd;
+long long off;
+long long end;
+{
+loff_t in_off = off;
+off_t soff;
+ssize_t n;
+
+#ifdef __NR_copy_file_range
+    while (in_off < end)
+    {
+        if ((n = syscall(__NR_copy_file_range, ifd, &in_off, ofd, NULL,
+                   (size_t) ((end - in_off > 0x40000000) ? 0x40000000 :
+                               (end - in_off)), 0)) <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+    }
+#endif
+    for (soff = in_off; soff < end;)
+    {
+        if ((n = sendfile(ofd, ifd, &soff,
+                   (size_t) ((end - soff > 0x40000000) ? 0x40000000 :
+                               (end - soff)))) <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+    }
+    return soff - off;
+}
+/*
+ * Queue up the rows taken from a data file. Rows that follow on from one
+ * another, as they do in a mapping or an arena chunk, go out as one piece.
+ */
+static long long write_rows(ovp, ip, nrows)
+struct out_vec * ovp;
+struct row_index * ip;
+int nrows;
+{
+unsigned char * p;
+unsigned long len;
+long long tot = 0;
+int i;
+int j;
+
+    for (i = 0; i < nrows; i = j)
+    {
+        p = ip->rowp[i];
+        len = ip->rowlen[i];
+        for (j = i + 1; j < nrows && ip->rowp[j] == p + len; j++)
+            len += ip->rowlen[j];
+        out_vec_put(ovp, p, len);
+        tot += len;
+    }
+    return tot;
+}
+/*
+ * Queue up a stretch of a mapped data file; for a file worked through in
+ * windows, this is how the rows taken are found, since the index only has the
+ * last of them. The kernel copies what it can, if ifd is open.
+ */
+static long long write_range(ovp, ifd, ip, off, end, tsp)
+struct out_vec * ovp;
+int ifd;
+struct row_index * ip;
+long long off;
+long long end;
+struct tidy_stats * tsp;
+{
+long long n;
+
+    if (ifd >= 0 && end > off)
+    {
+        out_vec_flush(ovp);
+        n = kernel_copy(ovp->fd, ifd, off, end);
+        tsp->avoided += n;
+        off += n;
+    }
+    if (end <= off)
+        return 0;
+    out_vec_put(ovp, ip->base + off, (unsigned long) (end - off));
+    return end - off;
+}
+static int tidy_data_file(scp, fcp, fname, tsp)
+struct scenario * scp;
+struct file_control * fcp;
+char * fname;
+struct tidy_stats * tsp;
+{
+struct row_index * ip = fcp->content.data.index;
+struct out_vec * ovp;
+struct stat st;
+char buf[65536];
+long long off;
+long long end;
+long long n;
+int windowed;
+int ifd;
+int len;
+
+    windowed = (scp->windowed != NULL && scp->windowed[fcp->slot]);
+    ovp = out_vec_new();
+/*
+ * Append the spent records to the spent file
+ */
+    sprintf(fname, "%s.spent", fcp->fname);
+    if ((ovp->fd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0)
+    {
+        fprintf(stderr, "Failed to open %s for append\n", fname);
+        perror("open()");
+        out_vec_free(ovp);
+        return 0;
+    }
+    if (windowed)
+        tsp->written += write_range(ovp, -1, ip, ip->start_off, ip->rest_off,
+                                    tsp);
+    else
+        tsp->written += write_rows(ovp, ip, fcp->content.data.recs);
+    out_vec_flush(ovp);
+    close(ovp->fd);
+/*
+ * Now the new file, starting with the heading
+ */
+    sprintf(fname, "%s.new", fcp->fname);
+    if ((ovp->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("open()");
+        out_vec_free(ovp);
+        return 0;
+    }
+    out_vec_put(ovp, fcp->content.data.col_defs->rowp,
+                     fcp->content.data.col_defs->len);
+    tsp->written += fcp->content.data.col_defs->len;
+    out_vec_flush(ovp);
+/*
+ * Find where the rest of the data starts. A pipe cannot be copied by the
+ * kernel, or read from an offset.
+ */
+    if (ip->base != NULL)
+    {
+        ifd = open(fcp->fname, O_RDONLY);
+        off = ip->rest_off;
+        end = ip->size;
+    }
+    else
+    {
+        ifd = fileno(fcp->fp);
+        if ((off = ftell(fcp->fp)) < 0
+          || fstat(ifd, &st) < 0
+          || !S_ISREG(st.st_mode))
+            off = -1;
+        else
+            end = st.st_size;
+    }
+    if (ifd >= 0 && off >= 0)
+    {
+        n = kernel_copy(ovp->fd, ifd, off, end);
+        tsp->avoided += n;
+        off += n;
+    }
+/*
+ * Whatever the kernel did not copy, we do
+ */
+    if (ip->base != NULL)
+    {
+        out_vec_put(ovp, ip->base + off, (unsigned long) (ip->size - off));
+        tsp->written += ip->size - off;
+        out_vec_flush(ovp);
+        if (ifd >= 0)
+            close(ifd);
+    }
+    else
+    {
+        if (off >= 0)
+        {
+            while ((len = pread(ifd, buf, sizeof(buf), off)) > 0)
+            {
+                out_vec_put(ovp, buf, len);
+                out_vec_flush(ovp);
+                tsp->written += len;
+                off += len;
+            }
+        }
+        else
+        {
+            while ((len = fread(buf, sizeof(char), sizeof(buf), fcp->fp)) > 0)
+            {
+                out_vec_put(ovp, buf, len);
+                out_vec_flush(ovp);
+                tsp->written += len;
+            }
+        }
+        fclose(fcp->fp);
+        fcp->fp = NULL;
+    }
+/*
+ * Now, if we can reuse values, put the used back on the end of the file.
+ */
+    if (scp->reuse_flag)
+    {
+        if (windowed)
+        {
+            ifd = open(fcp->fname, O_RDONLY);
+            tsp->written += write_range(ovp, ifd, ip, ip->start_off,
+                                        ip->rest_off, tsp);
+            if (ifd >= 0)
+                close(ifd);
+        }
+        else
+            tsp->written += write_rows(ovp, ip, fcp->content.data.recs);
+        out_vec_flush(ovp);
+    }
+    close(ovp->fd);
+    out_vec_free(ovp);
+    return 1;
+}
+#else
+static int tidy_data_file(scp, fcp, fname, tsp)
+struct scenario * scp;
+struct file_control * fcp;
+char * fname;
+struct tidy_stats * tsp;
+{
+FILE * ofp;
+struct row_index * ip = fcp->content.data.index;
+char buf[65536];
+int i;
+int len;
+
+/*
+ * Open spent file
+ */
+    sprintf(fname, "%s.spent", fcp->fname);
+    if ((ofp = fopen(fname, "ab")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for append\n", fname);
+        perror("fopen()");
+        return 0;
+    }
+/*
+ * Write out spent records to spent file
+ */
+    for (i = 0; i < fcp->content.data.recs; i++)
+    {
+        fwrite(ip->rowp[i], sizeof(char), ip->rowlen[i], ofp);
+        tsp->written += ip->rowlen[i];
+    }
+    fclose(ofp);
+/*
+ * Now the new file
+ */
+    sprintf(fname, "%s.new", fcp->fname);
+    if ((ofp = fopen(fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("fopen()");
+        return 0;
+    }
+/*
+ * Write out the heading
+ */
+    fwrite(fcp->content.data.col_defs->rowp, sizeof(char),
+                  fcp->content.data.col_defs->len, ofp);
+    tsp->written += fcp->content.data.col_defs->len;
+/*
+ * Now write out the remaining data from the current file; straight from the
+ * mapping if it was mapped.
+ */
+    if (ip->base != NULL)
+    {
+        fwrite(ip->base + ip->rest_off, sizeof(char),
+                      ip->size - ip->rest_off, ofp);
+        tsp->written += ip->size - ip->rest_off;
+    }
+    else
+    {
+        while ((len = fread(buf, sizeof(char), sizeof(buf), fcp->fp)) > 0)
+        {
+            fwrite(buf, sizeof(char), len, ofp);
+            tsp->written += len;
+        }
+        fclose(fcp->fp);
+        fcp->fp = NULL;
+    }
+/*
+ * Now, if we can reuse values, put the used back on the end of the file.
+ */
+    if (scp->reuse_flag)
+    {
+        for (i = 0; i < fcp->content.data.recs; i++)
+        {
+            fwrite(ip->rowp[i], sizeof(char), ip->rowlen[i], ofp);
+            tsp->written += ip->rowlen[i];
+        }
+    }
+    fclose(ofp);
+    return 1;
+}
+#endif
+static void final_data_tidy(scp)
+struct scenario * scp;
+{
+char * fname;
+struct file_control * fcp;
+struct tidy_stats ts;
+
+    memset((char *) &ts, 0, sizeof(ts));
+    for (fcp = scp->data_anchor; fcp != NULL; fcp = fcp->next_file)
+    {
+        if (fcp->content.data.recs < 1
+         || (scp->cursor_flag && strcmp(fcp->fname, "-")))
+        {
+            if (fcp->content.data.recs > 0 && scp->windowed != NULL
+             && scp->windowed[fcp->slot])
+                advance_cursor(scp, fcp);      /* Only known now it is done */
+            unlock_data_file(scp, fcp);
+            continue;                      /* Nothing to do, or already done */
+        }
+        fname = (char *) malloc(strlen(fcp->fname) + 7);
+        if (!tidy_data_file(scp, fcp, fname, &ts))
+        {
+            unlock_data_file(scp, fcp);
+            free(fname);
+            continue;
+        }
+        ts.files++;
+/*
+ * We could free up the allocated memory, but the program will exit shortly
+ * anyway, so why bother ...
+ */
+        unlink(fcp->fname);                  /* Unlink needed for Windows ... */
+        lrename(fname, fcp->fname);          /* Works across devices          */
+        unlock_data_file(scp, fcp);
+    }
+    scp->stats.bytes_written += ts.written + ts.avoided;
+    if (scp->verbose && ts.files > 0)
+        fprintf(stderr,
+    "Tidied %d data files; wrote %lld bytes, the kernel copied %lld bytes for us\n",
+                   ts.files, ts.written, ts.avoided);
+    return;
+}
+/***********************************************************************
+ * Parameters. Note that making re-use global to all the data files isn't
+ * right; it should probably be in the def file, since some data may be
+ * re-usable with some scripts but not with others.
+ */
+/*
+ * Read a memory size, with an optional K, M or G; returns 0 if it is not one.
+ */
+static long long mem_size(arg)
+char * arg;
+{
+long long n;
+char * xp;
+
+    n = strtoll(arg, &xp, 10);
+    switch (*xp)
+    {
+    case 'g':
+    case 'G':
+        n *= 1024;
+    case 'm':
+    case 'M':
+        n *= 1024;
+    case 'k':
+    case 'K':
+        n *= 1024;
+        xp++;
+    }
+    return (*xp == '\0' && xp > arg) ? n : 0;
+}
+#ifndef FC_BENCH
+static char * usage = "Option -h outputs this message.\n\
+Option -c outputs needed record counts rather than doing the clone.\n\
+Option -j n writes the users' scripts with n threads.\n\
+Option -W writes the scripts with writev() rather than stdio.\n\
+Option -v reports on what was done, and how quickly.\n\
+Option -n ignores the plan cache, and does not write one.\n\
+Option -C consumes data through cursor files, leaving the data files alone.\n\
+Option -s manifest clones all the bundles listed in the manifest.\n\
+Option -S socket serves clone requests on the socket; no parameters are given.\n\
+Option -M n[K|M|G] limits the data file indexes to n bytes, using windows.\n\
+Option -A writes each bundle's scripts to one archive; see fcextract.\n\
+Option -P n hands the scripts to n writer threads to write out.\n\
+Option -Q n lets each writer thread have up to n writes in flight (default 8).\n\
+Option -J file writes phase times and counts to file as JSON (- is stdout).\n\
+Option -H reports hardware counters (cycles, cache misses ...) per phase.\n\
+Parameters should be:\n\
+ 1 - Name of seed script (the directory in $PATH_HOME/scripts)\n\
+ 2 - The PID (the run id)\n\
+ 3 - The bundle\n\
+ 4 - Number of users\n\
+ 5 - Number of transactions each will do\n\
+ 6 - Whether or not variable length substitutions are allowed (Y/N)\n\
+ 7 - Event Wait Time (Think Time in seconds)\n\
+ 8 - Whether or not data values can be re-used (Y/N)\n\
+With -s, the parameters are 2, 6 and 8 above, and each line of the manifest\n\
+is SCRIPT|BUNDLE|USERS|TRANSACTIONS|THINK_TIME\n";
+/*
+ * Read a Y/N parameter; returns -1 if it is neither.
+ */
+static int yes_no(arg)
+char * arg;
+{
+    if (*arg == 'Y' || *arg == 'y')
+        return 1;
+    else
+    if (*arg == 'N' || *arg == 'n')
+        return 0;
+    else
+        return -1;
+}
+/*
+ * Write a string as a JSON string
+ */
+static void json_str(ofp, p)
+FILE * ofp;
+char * p;
+{
+    putc('"', ofp);
+    for (; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            fprintf(ofp, "\\%c", *p);
+        else
+        if ((unsigned char) *p < ' ')
+            fprintf(ofp, "\\u%04x", (unsigned char) *p);
+        else
+            putc(*p, ofp);
+    }
+    putc('"', ofp);
+    return;
+}
+/*
+ * Report the statistics; to stderr with -v, and as a JSON document to the -J
+ * file ("-" for stdout). Returns 0 if the JSON could not be written.
+ */
+static int report_stats(scp)
+struct scenario * scp;
+{
+struct run_stats * sp = &scp->stats;
+long peak = 0;
+double total = fc_now() - sp->started;
+FILE * ofp;
+int i;
+int j;
+#ifdef LINUX
+struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        peak = ru.ru_maxrss;           /* In kilobytes */
+#endif
+    if (scp->verbose)
+    {
+        fputs("Seconds:", stderr);
+        for (i = 0; i < PH_COUNT; i++)
+            fprintf(stderr, " %s %.3f", phase_names[i], sp->secs[i]);
+        fprintf(stderr, " total %.3f\n", total);
+        fprintf(stderr,
+"Read %lld bytes and parsed %lld rows; %lld pieces, %lld matches rejected\n\
+Made %lld substitutions and wrote %lld bytes; peak resident set %ld KB\n",
+                  sp->bytes_read, sp->rows_parsed, sp->pieces, sp->rejected,
+                  sp->subs, sp->bytes_written, peak);
+    }
+    if (sp->hw_on)
+    {
+        fprintf(stderr, "%-10s", "Phase");
+        for (j = 0; j < HW_COUNT; j++)
+            fprintf(stderr, " %16s", hw_names[j]);
+        putc('\n', stderr);
+        for (i = 0; i < PH_COUNT; i++)
+        {
+            fprintf(stderr, "%-10s", phase_names[i]);
+            for (j = 0; j < HW_COUNT; j++)
+                fprintf(stderr, " %16lld", sp->hw[i][j]);
+            putc('\n', stderr);
+        }
+    }
+    if (scp->stats_fname == NULL)
+        return 1;
+    if (!strcmp(scp->stats_fname, "-"))
+        ofp = stdout;
+    else
+    if ((ofp = fopen(scp->stats_fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", scp->stats_fname);
+        perror("fopen()");
+        return 0;
+    }
+    fputs("{\"pid\": ", ofp);
+    json_str(ofp, scp->pid);
+    fprintf(ofp, ", \"bundles\": %d, \"users\": %lld,\n \"seconds\": {",
+                 sp->bundles, sp->users);
+    for (i = 0; i < PH_COUNT; i++)
+        fprintf(ofp, "\"%s\": %.6f, ", phase_names[i], sp->secs[i]);
+    fprintf(ofp, "\"total\": %.6f},\n", total);
+    fprintf(ofp,
+" \"bytes_read\": %lld, \"bytes_written\": %lld, \"rows_parsed\": %lld,\n\
+ \"substitutions\": %lld, \"pieces\": %lld, \"matches_rejected\": %lld,\n\
+ \"peak_rss_kb\": %ld%s",
+                 sp->bytes_read, sp->bytes_written, sp->rows_parsed,
+                 sp->subs, sp->pieces, sp->rejected, peak,
+                 (sp->hw_on) ? ",\n" : "");
+    if (sp->hw_on)
+    {
+        fputs(" \"counters\": {", ofp);
+        for (i = 0; i < PH_COUNT; i++)
+        {
+            fprintf(ofp, "%s\n  \"%s\": {", (i > 0) ? "," : "",
+                         phase_names[i]);
+            for (j = 0; j < HW_COUNT; j++)
+                fprintf(ofp, "%s\"%s\": %lld", (j > 0) ? ", " : "",
+                             hw_names[j], sp->hw[i][j]);
+            putc('}', ofp);
+        }
+        fputs("}}\n", ofp);
+    }
+    else
+        fputs("}\n", ofp);
+    if (ofp == stdout)
+        return (fflush(ofp) == 0);
+    return (fclose(ofp) == 0);
+}
+#endif
+/*
+ * Validate a bundle's numbers. Returns 0 if any of them is no good.
+ */
+static int bundle_numbers(wcp, bundle, nusersp, ntransp, think_timep)
+struct write_control * wcp;
+char * bundle;
+char * nusersp;
+char * ntransp;
+char * think_timep;
+{
+int think_time;
+
+    wcp->bundle = bundle;
+    if ((wcp->nusers = atoi(nusersp)) < 1)
+    {
+        fprintf(stderr, "Illegal number of users %s\n", nusersp);
+        return 0;
+    }
+    if ((wcp->ntrans = atoi(ntransp)) < 1)
+    {
+        fprintf(stderr, "Illegal number of transactions %s\n", ntransp);
+        return 0;
+    }
+    if ((think_time = atoi(think_timep)) < 1)
+    {
+        fprintf(stderr, "Illegal think time %s\n", think_timep);
+        return 0;
+    }
+/*
+ * Construct a piece output control structure to use to patch the think_time
+ */
+    sprintf(wcp->think_time_buf, "\\W%d\\\n", think_time);
+    return 1;
+}
+/*
+ * Load a bundle's script, and stamp it and its def file for the plan cache.
+ * Returns 0 if the script cannot be loaded.
+ */
+static int load_script(wcp, script)
+struct write_control * wcp;
+char * script;
+{
+/*
+ * Attempt to load the script file. Give up if failed.
+ *
+ * The script file is the anchor for all the pieces to be written. It starts
+ * off with the whole file in one piece, but the chain of pieces gets extended
+ * as different locations are identified
+ */
+    wcp->script_file.fname = (char *) malloc(strlen(path_home) +
+                            2 * strlen(script) +
+                            strlen(path_ext) + 12);
+    sprintf(wcp->script_file.fname, "%s/scripts/%s/%s.%s",
+               path_home, script, script, path_ext);
+    if (!get_script(wcp))
+    {
+        free(wcp->script_file.fname);
+        wcp->script_file.fname = NULL;
+        return 0;
+    }
+    wcp->scp->stats.bytes_read += wcp->script_len;
+/*
+ * The def file is not read yet. A missing def file is not an error.
+ */ 
+    wcp->def_file.fname = (char *) malloc(strlen(path_home) +
+                            2 * strlen(script) + 15);
+    sprintf(wcp->def_file.fname, "%s/scripts/%s/%s.def",
+               path_home, script, script);
+    if (!wcp->scp->no_cache)
+    {
+        wcp->cache_fname = (char *) malloc(strlen(path_home) +
+                            2 * strlen(script) + 16);
+        sprintf(wcp->cache_fname, "%s/scripts/%s/%s.plan",
+               path_home, script, script);
+        file_stamp(wcp->script_file.fname, 0, wcp->script_base,
+                       wcp->script_len, &wcp->script_stamp);
+        if (!file_stamp(wcp->def_file.fname, 0, NULL, 0, &wcp->def_stamp))
+        {
+            free(wcp->def_file.fname);
+            wcp->def_file.fname = NULL;
+        }
+    }
+    return 1;
+}
+/*
+ * Read a bundle's def file, if it has one and it has not been read already.
+ */
+static void load_def(wcp)
+struct write_control * wcp;
+{
+    if (wcp->def_file.fname != NULL && wcp->def_file.content.data.rows == NULL
+     && !read_def(wcp))
+    {
+        free(wcp->def_file.fname);
+        wcp->def_file.fname = NULL;
+    }
+    return;
+}
+/*
+ * What follows is only for fastclone itself; fcbench.c goes through the
+ * phases on its own.
+ */
+#ifndef FC_BENCH
+/*
+ * Set up a bundle for cloning; validate its numbers, load its script and its
+ * def file, if it has one. Returns NULL if it cannot be done.
+ */
+static struct write_control * new_bundle(scp, script, bundle, nusersp,
+                                         ntransp, think_timep)
+struct scenario * scp;
+char * script;
+char * bundle;
+char * nusersp;
+char * ntransp;
+char * think_timep;
+{
+struct write_control * wcp;
+double started = phase_start(scp);
+
+    wcp = (struct write_control *) malloc(sizeof(struct write_control));
+    memset((unsigned char *) wcp, 0, sizeof(struct write_control));
+    wcp->scp = scp;
+    wcp->var_flag = scp->var_flag;
+    if (!bundle_numbers(wcp, bundle, nusersp, ntransp, think_timep)
+     || !load_script(wcp, script))
+    {
+        free(wcp);
+        return NULL;
+    }
+    started = phase_end(scp, PH_SCRIPT, started);
+/*
+ * If the plan worked out last time is still good, the def file is not needed
+ * unless something goes wrong later.
+ */
+    if (wcp->cache_fname == NULL || !load_plan_cache(wcp))
+        load_def(wcp);
+    phase_end(scp, PH_DEF, started);
+    return wcp;
+}
+/*
+ * Clone the bundles of a scenario. If ofp is not NULL, the number of records
+ * needed from each data file is written to it; with -c, that is all we do.
+ */
+static void clone_scenario(scp, wcps, nwc, ofp)
+struct scenario * scp;
+struct write_control ** wcps;
+int nwc;
+FILE * ofp;
+{
+struct file_control * dfp;
+long long want;
+int i;
+double started = phase_start(scp);
+
+/*
+ * Process the def files and go through the scripts, and work out how many
+ * records we need from each data file.
+ */
+    scan_scripts(scp, wcps, nwc);
+    started = phase_end(scp, PH_ASSEMBLE, started);
+    collect_needed_data(scp, wcps, nwc);
+    started = phase_end(scp, PH_DATA, started);
+    if (ofp != NULL)
+    {
+        for (dfp = scp->data_anchor; dfp != NULL; dfp = dfp->next_file)
+        {
+            want = rows_wanted(dfp, wcps, nwc);
+            fprintf(ofp, "%s|%d\n", dfp->fname,
+                     (want > 0x7fffffffL) ? 0x7fffffff : (int) want);
+        }
+        fflush(ofp);
+    }
 /*
- * Find the data files for the def file lines
+ * If we are just being asked to count the records required, we are done
  */
-    for (i = 0; i < wcp->def_file.content.data.recs; i++)
+    if (scp->count_flag)
+        return;
+    for (i = 0; i < nwc; i++)
     {
 /*
- * Before this allocation, rowp points within the single allocation for the
- * row, so it doesn't need to be free()ed.
+ * Otherwise, we are cloning the scripts. Create the linkages that will control
+ * the merge
  */
-        wcp->def_file.content.data.rows[i]->rowp = (char *)
-                   track_data_file(wcp, wcp->def_file.content.data.rows[i]);
-    }
+        assemble_clone_instructions(wcps[i], wcps[i]->think_time_buf);
+        started = phase_end(scp, PH_ASSEMBLE, started);
 /*
- * Then read in the data files chained to the write_control structure.
+ * We now loop through the write control instructions for each output file,
+ * and for each transaction in each output file, creating the script output
+ * files.
  */
-    for (dfcp = wcp->data_anchor;
-             dfcp != NULL;
-                 dfcp = dfcp->next_file)
-    {
-        dfcp->content.data.recs *= mult;
-        if (!count_flag)
-            get_data(dfcp);
+        do_the_clone(wcps[i]);
+        started = phase_end(scp, PH_CLONE, started);
     }
+/*
+ * Write out the spent data and re-write the data files, once for the whole
+ * scenario.
+ */
+    data_stats(scp);
+    final_data_tidy(scp);
+    phase_end(scp, PH_TIDY, started);
     return;
 }
 /*
- * Actually generate the output scripts; nusers files with ntrans transactions
- * in each.
+ * Read the scenario manifest. Like the def file, it has no heading line.
+ */
+static int get_manifest(fcp)
+struct file_control * fcp;
+{
+    fcp->content.data.col_defs = 
+           col_defs("SCRIPT|BUNDLE|USERS|TRANSACTIONS|THINK_TIME\n");
+    if (!get_data(fcp) || fcp->content.data.recs < 1)
+        return 0;
+    if (fcp->fp != stdin)
+        fclose(fcp->fp);
+    fcp->fp = NULL;
+    return 1;
+}
+#ifdef LINUX
+/******************************************************************************
+ * Server mode
+ ******************************************************************************
+ * Orchestration may call fastclone hundreds of times for a scenario. With -S,
+ * fastclone stays resident, listening on a Unix domain socket, and clones on
+ * request. Each script it has seen is kept loaded, with its def file parsed
+ * and both stamped for the plan cache; before each job, the script and the
+ * def file are checked with stat(), and loaded again if either has changed.
+ * The data files are not kept; the rows are different every time, and each
+ * job claims its own, under the data file locks.
+ *
+ * A request is a single line:
+ *
+ * CLONE|SCRIPT|PID|BUNDLE|USERS|TRANSACTIONS|THINK_TIME|VAR|REUSE[|DIRECTORY]
+ *
+ * VAR and REUSE are Y or N, like parameters 6 and 8 of a single clone: whether
+ * length changes are allowed, and whether data values can be re-used.
+ * Use COUNT|... to count the records needed and do nothing else. The reply is
+ * the counts that -c would give, one DATA_FILE|RECORDS line for each data file,
+ * then OK when the job is done. If the job cannot be started, the reply is
+ * ERROR|reason; if it fails part way, the reply just ends, and the reason is
+ * on the server's standard error.
+ *
+ * Each job is done by a child process, in DIRECTORY if one is given and in the
+ * server's working directory if not, so several can be running at once. The
+ * options the server was started with apply to all of them.
+ */
+struct resident_script {
+    char * script;
+    char * def_fname;
+    struct stat script_stat;
+    struct stat def_stat;           /* All zero if there is no def file */
+    struct write_control * wcp;     /* The script loaded, and the def parsed */
+    struct resident_script * next;
+};
+static int same_stat(s1, s2)
+struct stat * s1;
+struct stat * s2;
+{
+    return (s1->st_dev == s2->st_dev && s1->st_ino == s2->st_ino
+         && s1->st_size == s2->st_size
+         && s1->st_mtim.tv_sec == s2->st_mtim.tv_sec
+         && s1->st_mtim.tv_nsec == s2->st_mtim.tv_nsec
+         && s1->st_ctim.tv_sec == s2->st_ctim.tv_sec
+         && s1->st_ctim.tv_nsec == s2->st_ctim.tv_nsec);
+}
+/*
+ * Give back what a resident script holds
  */
-static void do_the_clone(wcp, pid, bundle, nusersp, ntransp)
+static void zap_resident_bundle(wcp)
 struct write_control * wcp;
-char * pid;
-char * bundle;
-char * nusersp;
-char * ntransp;
 {
-struct piece * npp;
-int nusers;
-int ntrans;
+struct row_track * rtp = &wcp->def_file.content.data;
 int i;
-int j;
-struct file_control * dfp;
 
-    if (strlen(wcp->script_file.fname) < (strlen(pid) + 8 +
-            strlen(nusersp) + strlen(bundle)))
+    if (wcp->script_mapped)
+        munmap(wcp->script_base, wcp->script_len);
+    else
+        free(wcp->script_base);
+    free(wcp->script_file.content.piece_anchor);
+    free(wcp->script_file.fname);
+    if (wcp->def_file.fname != NULL)
+        free(wcp->def_file.fname);
+    if (rtp->rows != NULL)
     {
+        if (rtp->arena != NULL)
+            zap_arena(rtp->arena);
+        else
+        for (i = 0; i < rtp->recs; i++)
+            free(rtp->rows[i]);
+        free(rtp->rows);
+    }
+    if (rtp->col_defs != NULL)
+        free(rtp->col_defs);
+    if (wcp->cache_fname != NULL)
+        free(wcp->cache_fname);
+    free(wcp);
+    return;
+}
 /*
- * Make sure there is space for the longest possible echo file name
+ * Find a script, loading it if it is new to us or has changed since it was
+ * loaded. The files are stat()ed before they are read, so that a change made
+ * while they are being read is seen next time.
  */
-        free(wcp->script_file.fname);
-        wcp->script_file.fname = (char *) malloc(
-           strlen(pid) + 8 + strlen(bundle) + strlen(nusersp));
+static struct resident_script * resident_script(scp, anchorp, script)
+struct scenario * scp;
+struct resident_script ** anchorp;
+char * script;
+{
+struct resident_script * rsp;
+struct stat script_stat;
+struct stat def_stat;
+char * script_fname;
+
+    for (rsp = *anchorp; rsp != NULL && strcmp(rsp->script, script);
+            rsp = rsp->next);
+    script_fname = (char *) malloc(strlen(path_home) + 2 * strlen(script) +
+                            strlen(path_ext) + 12);
+    sprintf(script_fname, "%s/scripts/%s/%s.%s",
+               path_home, script, script, path_ext);
+    if (rsp == NULL)
+    {
+        rsp = (struct resident_script *) calloc(1,
+                           sizeof(struct resident_script));
+        rsp->script = strdup(script);
+        rsp->def_fname = (char *) malloc(strlen(path_home) +
+                            2 * strlen(script) + 15);
+        sprintf(rsp->def_fname, "%s/scripts/%s/%s.def",
+               path_home, script, script);
+        rsp->next = *anchorp;
+        *anchorp = rsp;
     }
-    nusers = atoi(nusersp);
-    ntrans = atoi(ntransp);
-    for (i = 0; i < nusers; i++)
+    memset((char *) &script_stat, 0, sizeof(script_stat));
+    memset((char *) &def_stat, 0, sizeof(def_stat));
+    stat(script_fname, &script_stat);
+    stat(rsp->def_fname, &def_stat);
+    free(script_fname);
+    if (rsp->wcp != NULL)
     {
-        sprintf(wcp->script_file.fname, "echo%s.%s.%d", pid, bundle, i);
-        if ((wcp->script_file.fp = fopen(wcp->script_file.fname, "wb")) == NULL)
-        {
-            fprintf(stderr, "Failed to open %s for write\n",
-                                       wcp->script_file.fname);
-            perror("fopen()");
-            continue;
-        }
-        for (j = 0; j < ntrans; j++)
-        {
-            for (npp = wcp->script_file.content.piece_anchor;
-                     npp != NULL;
-                         npp = npp->next_piece)
-                npp->write_fun(wcp->script_file.fp, npp);
+        if (same_stat(&script_stat, &rsp->script_stat)
+         && same_stat(&def_stat, &rsp->def_stat))
+            return rsp;
+        if (scp->verbose)
+            fprintf(stderr, "Script %s has changed; loading it again\n",
+                      script);
+        zap_resident_bundle(rsp->wcp);
+        rsp->wcp = NULL;
+    }
+    rsp->script_stat = script_stat;
+    rsp->def_stat = def_stat;
+    rsp->wcp = (struct write_control *) calloc(1,
+                           sizeof(struct write_control));
+    rsp->wcp->scp = scp;
+    if (!load_script(rsp->wcp, script))
+    {
+        free(rsp->wcp);
+        rsp->wcp = NULL;
+        return NULL;
+    }
+    load_def(rsp->wcp);
+    return rsp;
+}
 /*
- * Bump on all the data files
+ * Send a one line reply without stdio; used before a job is started.
  */
-            for (dfp = wcp->data_anchor; dfp != NULL; dfp = dfp->next_file)
-            {
-                dfp->content.data.cur_row++;
-                if (dfp->content.data.cur_row >= dfp->content.data.recs)
-                    dfp->content.data.cur_row = 0;
-            }
-        }
-        fclose(wcp->script_file.fp);
-    }
+static void reply(fd, msg1, msg2)
+int fd;
+char * msg1;
+char * msg2;
+{
+char buf[512];
+
+    snprintf(buf, sizeof(buf), "%s%s\n", msg1, msg2);
+    write(fd, buf, strlen(buf));
     return;
 }
-/******************************************************************************
- * Tidy up the data files used to feed the merge
- ******************************************************************************
- * Loop through the data file chain. For each data file used:
- * -    We add any data we have taken to the spent file.
- * -    We write out the rest of the data file to a new version of same
- * -    If we are re-using data, we add our used data to the end of each file
+/*
+ * Read a request, and start a child process to do it
  */
-static void final_data_tidy(wcp, reuse_flag)
-struct write_control * wcp;
-int reuse_flag;
+static void serve_request(scp, anchorp, listen_fd, fd)
+struct scenario * scp;
+struct resident_script ** anchorp;
+int listen_fd;
+int fd;
 {
-char * spent_file_name;
+char buf[4096];
+char * fields[11];
+struct resident_script * rsp;
+struct write_control * wcp;
+struct scenario job;
 FILE * ofp;
-struct file_control * fcp;
-char buf[65536];
-int i;
+char * xp;
 int len;
+int n;
+int nf;
 
-    for (fcp = wcp->data_anchor; fcp != NULL; fcp = fcp->next_file)
+    for (len = 0; len < sizeof(buf) - 1;)
     {
-        if (fcp->content.data.recs < 1)
-            continue;
-/*
- * Create spent file name and open spent file
- */
-        spent_file_name =(char *) malloc(strlen(fcp->fname) + 7);
-        sprintf(spent_file_name, "%s.spent", fcp->fname);
-        if ((ofp = fopen(spent_file_name, "ab")) == NULL)
+        if ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) < 0)
         {
-            fprintf(stderr, "Failed to open %s for append\n",
-                                       spent_file_name);
-            perror("fopen()");
-            free(spent_file_name);
-            continue;
+            if (errno == EINTR)
+                continue;
+            break;
         }
+        if (n == 0)
+            break;
+        len += n;
+        if (memchr(buf + len - n, '\n', n) != NULL)
+            break;
+    }
+    buf[len] = '\0';
+    if ((xp = strchr(buf, '\n')) == NULL)
+    {
+        reply(fd, "ERROR|incomplete request", "");
+        return;
+    }
+    if (xp > buf && *(xp - 1) == '\r')
+        xp--;
+    *xp = '\0';
+    for (nf = 1, fields[0] = buf, xp = buf; nf < 11
+           && (xp = strchr(xp, '|')) != NULL; nf++)
+    {
+        *xp++ = '\0';
+        fields[nf] = xp;
+    }
+    memcpy((char *) &job, (char *) scp, sizeof(job));
+    if (nf < 9 || nf > 10
+     || (strcmp(fields[0], "CLONE") && strcmp(fields[0], "COUNT")))
+    {
+        reply(fd, "ERROR|expected CLONE or COUNT and 8 or 9 fields", "");
+        return;
+    }
+    job.count_flag = !strcmp(fields[0], "COUNT");
+    job.pid = fields[2];
+    if ((job.var_flag = yes_no(fields[7])) < 0)
+    {
+        reply(fd, "ERROR|illegal variable length indication ", fields[7]);
+        return;
+    }
+    if ((job.reuse_flag = yes_no(fields[8])) < 0)
+    {
+        reply(fd, "ERROR|illegal data re-use indication ", fields[8]);
+        return;
+    }
+    if ((rsp = resident_script(scp, anchorp, fields[1])) == NULL)
+    {
+        reply(fd, "ERROR|cannot load script ", fields[1]);
+        return;
+    }
+    if (scp->verbose)
+        fprintf(stderr, "%s %s bundle %s for %s\n", fields[0], fields[1],
+                   fields[3], fields[2]);
+    switch (fork())
+    {
+    case -1:
+        perror("fork()");
+        reply(fd, "ERROR|cannot fork", "");
+        return;
+    case 0:
+        break;
+    default:
+        return;
+    }
 /*
- * Write out spent records to spent file
+ * The child does the job, with its own copy of the resident script
  */
-        for (i = 0; i < fcp->content.data.recs; i++)
-            fwrite(fcp->content.data.rows[i]->rowp, sizeof(char), 
-                              fcp->content.data.rows[i]->len, ofp);
+    close(listen_fd);
+    signal(SIGCHLD, SIG_DFL);
+    if (nf == 10 && chdir(fields[9]) < 0)
+    {
+        perror("chdir()");
+        reply(fd, "ERROR|cannot change directory to ", fields[9]);
+        exit(1);
+    }
+    wcp = (struct write_control *) malloc(sizeof(struct write_control));
+    memcpy((char *) wcp, (char *) rsp->wcp, sizeof(struct write_control));
+    wcp->scp = &job;
+    wcp->var_flag = job.var_flag;
+    if (!bundle_numbers(wcp, fields[3], fields[4], fields[5], fields[6]))
+    {
+        reply(fd, "ERROR|illegal numbers for bundle ", fields[3]);
+        exit(1);
+    }
+    if (wcp->cache_fname != NULL)
+        load_plan_cache(wcp);
+    if ((ofp = fdopen(fd, "wb")) == NULL)
+        exit(1);
+    clone_scenario(&job, &wcp, 1, ofp);
+    if (job.write_errors > 0)
+    {
         fclose(ofp);
+        exit(1);
+    }
+    fputs("OK\n", ofp);
+    fclose(ofp);
+    exit(0);
+}
 /*
- * Now the new file
- */
-        sprintf(spent_file_name, "%s.new", fcp->fname);
-        if ((ofp = fopen(spent_file_name, "wb")) == NULL)
-        {
-            fprintf(stderr, "Failed to open %s for write\n",
-                                       spent_file_name);
-            perror("fopen()");
-            free(spent_file_name);
-            continue;
-        }
-/*
- * Write out the heading
- */
-        fwrite(fcp->content.data.col_defs->rowp, sizeof(char),
-                      fcp->content.data.col_defs->len, ofp);
-/*
- * Now write out the remaining data from the current file
+ * Listen on the socket for ever
  */
-        while ((len = fread(buf, sizeof(char), sizeof(buf), fcp->fp)) > 0)
-            fwrite(buf, sizeof(char), len, ofp);
-        fclose(fcp->fp);
+static void serve(scp, path)
+struct scenario * scp;
+char * path;
+{
+struct sockaddr_un sun;
+struct resident_script * anchor = NULL;
+struct timeval tv;
+int listen_fd;
+int fd;
+
+    memset((char *) &sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return;
+    }
+    strcpy(sun.sun_path, path);
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        perror("socket()");
+        return;
+    }
 /*
- * Now, if we can reuse values, put the used back on the end of the file.
+ * Only take over the socket if nothing is answering on it
  */
-        if (reuse_flag)
+    if (connect(listen_fd, (struct sockaddr *) &sun, sizeof(sun)) == 0)
+    {
+        fprintf(stderr, "A server is already listening on %s\n", path);
+        close(listen_fd);
+        return;
+    }
+    close(listen_fd);
+    unlink(path);
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+     || bind(listen_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0
+     || listen(listen_fd, 64) < 0)
+    {
+        fprintf(stderr, "Cannot listen on %s\n", path);
+        perror("bind()");
+        return;
+    }
+    signal(SIGCHLD, SIG_IGN);           /* No zombies */
+    signal(SIGPIPE, SIG_IGN);           /* A job finishes if its client goes */
+    for (;;)
+    {
+        if ((fd = accept(listen_fd, NULL, NULL)) < 0)
         {
-            for (i = 0; i < fcp->content.data.recs; i++)
-                fwrite(fcp->content.data.rows[i]->rowp, sizeof(char), 
-                              fcp->content.data.rows[i]->len, ofp);
+            if (errno != EINTR)
+                perror("accept()");
+            continue;
         }
-        fclose(ofp);
-/*
- * We could free up the allocated memory, but the program will exit shortly
- * anyway, so why bother ...
- */
-        unlink(fcp->fname);                  /* Unlink needed for Windows ... */
-        lrename(spent_file_name, fcp->fname);/* Works across devices          */
+        tv.tv_sec = 30;                 /* A silent client cannot hold us up */
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv));
+        serve_request(scp, &anchor, listen_fd, fd);
+        close(fd);
     }
-    return;
 }
-/***********************************************************************
- * Parameters. Note that making re-use global to all the data files isn't
- * right; it should probably be in the def file, since some data may be
- * re-usable with some scripts but not with others.
- */
-static char * usage = "Option -h outputs this message.\n\
-Option -c outputs needed record counts rather than doing the clone.\n\
-Parameters should be:\n\
- 1 - Name of seed script (the directory in $PATH_HOME/scripts)\n\
- 2 - The PID (the run id)\n\
- 3 - The bundle\n\
- 4 - Number of users\n\
- 5 - Number of transactions each will do\n\
- 6 - Whether or not variable length substitutions are allowed (Y/N) (ignored)\n\
- 7 - Event Wait Time (Think Time in seconds)\n\
- 8 - Whether or not data values can be re-used (Y/N)\n";
+#endif
 /****************************************************************************
- * Main program starts here
+ * Main program starts here; fcbench.c has its own.
  * VVVVVVVVVVVVVVVVVVVVVVVV
  */
 int main(argc, argv)
 int argc;
 char ** argv;
 {
-struct write_control wc;
-char * fname;
-int ntrans;
-int nusers;
-int reuse_flag;
-int count_flag;
-int think_time;
+struct scenario sc;
+struct write_control ** wcps;
+struct file_control manifest;
+struct row * mrp;
+int nwc;
+int i;
 int mult;
-struct file_control * dfp;
-char think_time_buf[15];
+char * server_path = NULL;
 
     if ((path_home = getenv("PATH_HOME")) == NULL)
     {
@@ -878,14 +4243,86 @@ char think_time_buf[15];
 /*
  * Look for options
  */
-    count_flag = 0;
-    memset((unsigned char *) &wc, 0, sizeof(wc));
-    while ( ( mult = getopt( argc, argv, "hc" ) ) != EOF )
+    memset((unsigned char *) &sc, 0, sizeof(sc));
+    memset((unsigned char *) &manifest, 0, sizeof(manifest));
+    sc.stats.started = fc_now();
+    sc.nthreads = 1;
+    sc.pipe_depth = 8;
+    while ( ( mult = getopt( argc, argv, "hcj:WvnCs:S:M:AP:Q:J:H" ) ) != EOF )
     {
         switch ( mult )
         {
         case 'c':
-            count_flag = 1;
+            sc.count_flag = 1;
+            break;
+        case 'j':
+            if ((sc.nthreads = atoi(optarg)) < 1)
+            {
+                fprintf(stderr, "Illegal number of threads %s\n", optarg);
+                fputs(usage, stderr);
+                exit(1);
+            }
+            break;
+        case 'W':
+#ifdef LINUX
+            sc.out_mode = OUT_WRITEV;
+#endif
+            break;
+        case 'v':
+            sc.verbose = 1;
+            break;
+        case 'n':
+            sc.no_cache = 1;
+            break;
+        case 'C':
+            sc.cursor_flag = 1;
+            break;
+        case 'A':
+            sc.archive_flag = 1;
+            break;
+        case 'P':
+            if ((sc.pipe_writers = atoi(optarg)) < 1)
+            {
+                fprintf(stderr, "Illegal number of writers %s\n", optarg);
+                fputs(usage, stderr);
+                exit(1);
+            }
+#ifndef LINUX
+            fputs("The writer pipeline is not available on this platform\n",
+                      stderr);
+            sc.pipe_writers = 0;
+#endif
+            break;
+        case 'Q':
+            if ((sc.pipe_depth = atoi(optarg)) < 1)
+            {
+                fprintf(stderr, "Illegal queue depth %s\n", optarg);
+                fputs(usage, stderr);
+                exit(1);
+            }
+            break;
+        case 'J':
+            sc.stats_fname = optarg;
+            break;
+        case 'H':
+#ifdef LINUX
+            if (!sc.stats.hw_on && !hw_open(&sc.stats))
+#endif
+                fputs("Hardware counters are not available\n", stderr);
+            break;
+        case 's':
+            manifest.fname = optarg;
+            break;
+        case 'S':
+            server_path = optarg;
+            break;
+        case 'M':
+            if ((sc.max_mem = mem_size(optarg)) < 1)
+            {
+                fprintf(stderr, "Illegal memory size %s\n", optarg);
+                fputs(usage, stderr);
+                exit(1);
+            }
             break;
         case 'h':
         default:
@@ -893,122 +4330,93 @@ char think_time_buf[15];
              exit(1);
         }
     }
+    if (server_path != NULL)
+    {
+#ifdef LINUX
+        serve(&sc, server_path);
+#else
+        fputs("Server mode is not available on this platform\n", stderr);
+#endif
+        exit(1);
+    }
 /*
- * Validate the arguments
+ * Validate the arguments. The manifest supplies the script, bundle, users,
+ * transactions and think time for each bundle.
  */
-    if (argc - optind < 8)
+    if (argc - optind < ((manifest.fname == NULL) ? 8 : 3))
     {
         fputs("Too few parameters\n", stderr);
         fputs(usage, stderr);
         exit(1);
     }
-    if ((nusers = atoi(argv[optind + 3])) < 1)
+    if (manifest.fname == NULL)
     {
-        fprintf(stderr, "Illegal number of users %s\n", argv[optind + 3]);
-        fputs(usage, stderr);
-        exit(1);
+        sc.pid = argv[optind + 1];
+        i = 5;
+        mult = 7;
     }
-    if ((ntrans = atoi(argv[optind + 4])) < 1)
+    else
     {
-        fprintf(stderr, "Illegal number of transactions %s\n", argv[optind + 4]);
-        fputs(usage, stderr);
-        exit(1);
+        sc.pid = argv[optind];
+        i = 1;
+        mult = 2;
     }
-    if (*argv[optind + 5] == 'Y' || *argv[optind + 5] == 'y')
-        wc.var_flag = 1;
-    else
-    if (*argv[optind + 5] == 'N' || *argv[optind + 5] == 'n')
-        wc.var_flag = 0;
-    else
+    if ((sc.var_flag = yes_no(argv[optind + i])) < 0)
     {
         fprintf(stderr,
 "Illegal variable length substitution safe indication %s; must by Y or N (or y or n)\n",
-                argv[optind + 5]);
-        exit(1);
-    }
-    if ((think_time = atoi(argv[optind + 6])) < 1)
-    {
-        fprintf(stderr, "Illegal think time %s\n", argv[optind + 6]);
-        fputs(usage, stderr);
+                argv[optind + i]);
         exit(1);
     }
-/*
- * Construct a piece output control structure to use to patch the think_time
- */
-    sprintf(think_time_buf, "\\W%d\\\n", think_time);
-    if (*argv[optind + 7] == 'Y' || *argv[optind + 7] == 'y')
-        reuse_flag = 1;
-    else
-    if (*argv[optind + 7] == 'N' || *argv[optind + 7] == 'n')
-        reuse_flag = 0;
-    else
+    if ((sc.reuse_flag = yes_no(argv[optind + mult])) < 0)
     {
         fprintf(stderr,
            "Illegal data re-use indication %s; must by Y or N (or y or n)\n",
-                argv[optind + 7]);
+                argv[optind + mult]);
         fputs(usage, stderr);
         exit(1);
     }
 /*
- * Attempt to load the script file. Give up if failed.
- *
- * The script file is the anchor for all the pieces to be written. It starts
- * off with the whole file in one piece, but the chain of pieces gets extended
- * as different locations are identified
- */
-    wc.script_file.fname = (char *) malloc(strlen(path_home) +
-                            2 * strlen(argv[optind]) +
-                            strlen(path_ext) + 12);
-    sprintf(wc.script_file.fname, "%s/scripts/%s/%s.%s",
-               path_home, argv[optind], argv[optind], path_ext);
-    if (!get_script(&wc.script_file))
-        exit(1);
-/*
- * Attempt to load the def file. A missing def file is not an error.
- */ 
-    wc.def_file.fname = (char *) malloc(strlen(path_home) +
-                            2 * strlen(argv[optind]) + 15);
-    sprintf(wc.def_file.fname, "%s/scripts/%s/%s.def",
-               path_home, argv[optind], argv[optind]);
-    if (get_def(&wc.def_file))
-/*
- * Process the def file, and work out how many records we need from each data
- * file.
+ * Load the scripts and def files of the bundles to be cloned.
  */
-        collect_needed_data(&wc, nusers * ntrans, count_flag);
-    else
+    if (manifest.fname == NULL)
     {
-        free(wc.def_file.fname);
-        wc.def_file.fname = NULL;
+        nwc = 1;
+        wcps = (struct write_control **) malloc(sizeof(struct write_control *));
+        if ((wcps[0] = new_bundle(&sc, argv[optind], argv[optind + 2],
+                  argv[optind + 3], argv[optind + 4], argv[optind + 6]))
+                        == NULL)
+        {
+            fputs(usage, stderr);
+            exit(1);
+        }
     }
-/*
- * If we are just being asked to count the records required, do so and exit
- */
-    if (count_flag)
+    else
     {
-        for (dfp = wc.data_anchor; dfp != NULL; dfp = dfp->next_file)
-            printf("%s|%d\n", dfp->fname, dfp->content.data.recs);
-
-        exit(0);
+        if (!get_manifest(&manifest))
+        {
+            fprintf(stderr, "Nothing to do in manifest %s\n", manifest.fname);
+            exit(1);
+        }
+        nwc = manifest.content.data.recs;
+        wcps = (struct write_control **)
+                   malloc(sizeof(struct write_control *) * nwc);
+        for (i = 0; i < nwc; i++)
+        {
+            mrp = manifest.content.data.rows[i];
+            if ((wcps[i] = new_bundle(&sc, mrp->colp[0], mrp->colp[1],
+                     mrp->colp[2], mrp->colp[3], mrp->colp[4])) == NULL)
+            {
+                fprintf(stderr, "Cannot clone %s bundle %s in manifest %s\n",
+                           mrp->colp[0], mrp->colp[1], manifest.fname);
+                exit(1);
+            }
+        }
     }
-/*
- * Otherwise, we are cloning the script. Create the linkages that will control
- * the merge
- */
-    assemble_clone_instructions(&wc, think_time_buf);
-/*
- * We now loop through the write control instructions for each output file,
- * and for each transaction in each output file, creating the script output
- * files.
- */
-    do_the_clone(&wc, argv[optind + 1], argv[optind + 2], argv[optind + 3],
-                      argv[optind + 4]);
-/*
- * Write out the spent data and re-write the data files
- */
-    final_data_tidy(&wc, reuse_flag);
+    clone_scenario(&sc, wcps, nwc, (sc.count_flag) ? stdout : NULL);
 /*
  * Finish
  */
-    exit(0);
+    exit((report_stats(&sc) && sc.write_errors == 0) ? 0 : 1);
 }
+#endif
@@ -0,0 +1,263 @@
+/************************************************************************
+ * fcarch.c - Archives of cloned scripts
+ *
+ * Creating a file for every user costs more in file system metadata than the
+ * writing does, when there are very many users. These routines put the users'
+ * scripts in a single archive instead, and get them back out again; see
+ * fcarch.h for the layout.
+ *
+ * The scripts can be put in any order, by any number of threads. Each is
+ * given the next stretch of the archive, and written there, so the archive
+ * is written from front to back in large pieces. The index is only written
+ * when the archive is closed.
+ */
+static char * sccs_id =  "@(#) $Name$ $Id$\n\
+Copyright (c) E2 Systems Limited 2009\n";
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef LCC
+#include <unistd.h>
+#endif
+#include "fcarch.h"
+#ifdef LINUX
+#include <fcntl.h>
+#include <pthread.h>
+#define fc_seek fseeko
+#define fc_tell ftello
+#else
+#define fc_seek fseek
+#define fc_tell ftell
+#endif
+/*
+ * Write out a buffer at an offset; returns 0 if it could not all be written
+ */
+static int fca_write_at(fap, off, buf, len)
+struct fc_archive * fap;
+long long off;
+char * buf;
+unsigned long len;
+{
+#ifdef LINUX
+ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = pwrite(fap->fd, buf, len, (off_t) off)) <= 0)
+            return 0;
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 1;
+#else
+    if (fc_seek(fap->fp, off, SEEK_SET) != 0)
+        return 0;
+    return (fwrite(buf, sizeof(char), len, fap->fp) == len);
+#endif
+}
+/*
+ * Start an archive for nusers users' scripts
+ */
+struct fc_archive * fca_create(fname, nusers)
+char * fname;
+int nusers;
+{
+struct fc_archive * fap;
+
+    fap = (struct fc_archive *) calloc(1, sizeof(struct fc_archive));
+    fap->fname = strdup(fname);
+    fap->writing = 1;
+    fap->nusers = nusers;
+#ifdef LINUX
+    if ((fap->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("open()");
+        free(fap->fname);
+        free(fap);
+        return NULL;
+    }
+    fap->guard = malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init((pthread_mutex_t *) fap->guard, NULL);
+#else
+    if ((fap->fp = fopen(fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("fopen()");
+        free(fap->fname);
+        free(fap);
+        return NULL;
+    }
+#endif
+    fap->off = (long long *) calloc(nusers + 1, sizeof(long long));
+    fap->len = (long long *) calloc(nusers + 1, sizeof(long long));
+    fap->end = strlen(FCA_MAGIC);
+    if (!fca_write_at(fap, 0, FCA_MAGIC, strlen(FCA_MAGIC)))
+    {
+        fprintf(stderr, "Failed to write %s\n", fname);
+        perror("write()");
+    }
+    return fap;
+}
+/*
+ * Put a user's script in the archive. Only the claiming of the space is done
+ * under the lock; the writes themselves can go on together.
+ */
+int fca_put(fap, user, buf, len)
+struct fc_archive * fap;
+int user;
+char * buf;
+unsigned long len;
+{
+long long off;
+
+    if (user < 0 || user >= fap->nusers)
+        return 0;
+#ifdef LINUX
+    pthread_mutex_lock((pthread_mutex_t *) fap->guard);
+#endif
+    off = fap->end;
+    fap->end += len;
+#ifdef LINUX
+    pthread_mutex_unlock((pthread_mutex_t *) fap->guard);
+#endif
+    if (!fca_write_at(fap, off, buf, len))
+    {
+        fprintf(stderr, "Failed to write user %d to %s\n", user, fap->fname);
+        perror("write()");
+        return 0;
+    }
+    fap->off[user] = off;
+    fap->len[user] = len;
+    return 1;
+}
+/*
+ * Finish off an archive being written, or let go of one being read. Returns
+ * 0 if the index could not be written.
+ */
+int fca_close(fap)
+struct fc_archive * fap;
+{
+char * buf;
+char * xp;
+int ret = 1;
+int i;
+
+    if (fap->writing)
+    {
+        buf = (char *) malloc(FCA_INDEX_LEN * fap->nusers +
+                              FCA_TRAILER_LEN + 1);
+        for (xp = buf, i = 0; i < fap->nusers; i++, xp += FCA_INDEX_LEN)
+            sprintf(xp, "%020lld %020lld\n", fap->off[i], fap->len[i]);
+        sprintf(xp, "FCA %010d %020lld\n", fap->nusers, fap->end);
+        if (!fca_write_at(fap, fap->end, buf,
+                (unsigned long) (xp - buf + FCA_TRAILER_LEN)))
+        {
+            fprintf(stderr, "Failed to write the index of %s\n", fap->fname);
+            perror("write()");
+            ret = 0;
+        }
+        free(buf);
+        free(fap->off);
+        free(fap->len);
+#ifdef LINUX
+        if (close(fap->fd) < 0)
+            ret = 0;
+        pthread_mutex_destroy((pthread_mutex_t *) fap->guard);
+        free(fap->guard);
+        fap->fp = NULL;
+#endif
+    }
+    if (fap->fp != NULL && fclose(fap->fp) != 0)
+        ret = 0;
+    free(fap->fname);
+    free(fap);
+    return ret;
+}
+/*
+ * Open an archive for reading, and check that it is one
+ */
+struct fc_archive * fca_open(fname)
+char * fname;
+{
+struct fc_archive * fap;
+char buf[FCA_TRAILER_LEN + 1];
+long long size;
+
+    fap = (struct fc_archive *) calloc(1, sizeof(struct fc_archive));
+    if ((fap->fp = fopen(fname, "rb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for read\n", fname);
+        perror("fopen()");
+        free(fap);
+        return NULL;
+    }
+    fap->fname = strdup(fname);
+    buf[FCA_TRAILER_LEN] = '\0';
+    if (fc_seek(fap->fp, 0, SEEK_END) != 0
+     || (size = fc_tell(fap->fp)) < (long long) (strlen(FCA_MAGIC) +
+                                              FCA_TRAILER_LEN)
+     || fc_seek(fap->fp, size - FCA_TRAILER_LEN, SEEK_SET) != 0
+     || fread(buf, sizeof(char), FCA_TRAILER_LEN, fap->fp) != FCA_TRAILER_LEN
+     || sscanf(buf, "FCA %d %lld", &fap->nusers, &fap->index_off) != 2
+     || fap->index_off + ((long long) fap->nusers) * FCA_INDEX_LEN +
+                   FCA_TRAILER_LEN != size)
+    {
+        fprintf(stderr, "%s is not a fastclone archive\n", fname);
+        fca_close(fap);
+        return NULL;
+    }
+    return fap;
+}
+/*
+ * Find where a user's script is. Returns 0 if there is no such user.
+ */
+int fca_find(fap, user, offp, lenp)
+struct fc_archive * fap;
+int user;
+long long * offp;
+long long * lenp;
+{
+char buf[FCA_INDEX_LEN + 1];
+
+    buf[FCA_INDEX_LEN] = '\0';
+    if (user < 0 || user >= fap->nusers
+     || fc_seek(fap->fp, fap->index_off + ((long long) user) * FCA_INDEX_LEN,
+                   SEEK_SET) != 0
+     || fread(buf, sizeof(char), FCA_INDEX_LEN, fap->fp) != FCA_INDEX_LEN
+     || sscanf(buf, "%lld %lld", offp, lenp) != 2)
+        return 0;
+    return 1;
+}
+/*
+ * Copy a user's script to a file. Returns the number of bytes copied, or -1 if
+ * there is no such user.
+ */
+long long fca_copy(fap, user, ofp)
+struct fc_archive * fap;
+int user;
+FILE * ofp;
+{
+char buf[65536];
+long long off;
+long long len;
+long long left;
+int n;
+
+    if (!fca_find(fap, user, &off, &len)
+     || (len > 0 && fc_seek(fap->fp, off, SEEK_SET) != 0))
+        return -1;
+    for (left = len; left > 0; left -= n)
+    {
+        if ((n = fread(buf, sizeof(char),
+                  (left > sizeof(buf)) ? sizeof(buf) : (int) left,
+                       fap->fp)) <= 0)
+            return -1;
+        if (fwrite(buf, sizeof(char), n, ofp) != n)
+            return -1;
+    }
+    return len;
+}
@@ -0,0 +1,43 @@
+/************************************************************************
+ * fcarch.h - Archives of cloned scripts
+ *
+ * Rather than a file for each user, fastclone -A can put all the users'
+ * scripts for a bundle in a single archive. The archive is:
+ *
+ * FASTCLONE ARCHIVE 1\n        (the heading)
+ * The scripts, one after the other, in the order they were finished
+ * An index line for each user, in user order; the offset and the length of
+ *     the script, as 20 digit decimal numbers separated by a space
+ * A trailer line; FCA, the number of users (10 digits) and the offset of
+ *     the index (20 digits), separated by spaces
+ *
+ * All the index lines are the same length, so any user's script can be found
+ * by reading the trailer and then one index line. A user whose script was not
+ * written has an offset and length of 0.
+ *
+ * @(#) $Name$ $Id$ Copyright (c) E2 Systems Limited 2009
+ */
+#ifndef FCARCH_H
+#define FCARCH_H
+#define FCA_MAGIC       "FASTCLONE ARCHIVE 1\n"
+#define FCA_INDEX_LEN   42
+#define FCA_TRAILER_LEN 36
+struct fc_archive {
+    char * fname;
+    int writing;                /* Whether we are writing it or reading it  */
+    int fd;                     /* Written to at offsets, on Linux          */
+    FILE * fp;                  /* Read from, or written to elsewhere       */
+    int nusers;
+    long long end;              /* Where the next script goes               */
+    long long index_off;        /* Where the index is, when reading         */
+    long long * off;            /* Offset and length of each user's script, */
+    long long * len;            /* when writing                             */
+    void * guard;               /* Serialises the writers, if threaded      */
+};
+struct fc_archive * fca_create();
+int fca_put();
+int fca_close();
+struct fc_archive * fca_open();
+int fca_find();
+long long fca_copy();
+#endif
@@ -0,0 +1,372 @@
+/*
+ * fcbench.c - time fastclone, a phase at a time, on a synthetic scenario
+ ***********************************************************************
+ * Parameters
+ * 1 - Directory to put the scenario in (it becomes PATH_HOME); the scripts
+ *     are written to its out sub-directory
+ * Options:
+ * -l  Lines in the seed script (default 10000)
+ * -s  Substitutions on each line (default 2)
+ * -w  Width the script lines are padded out to (default 80)
+ * -f  Data files (default 4)
+ * -c  Columns in each data file (default 6)
+ * -r  Rows in each data file (default 100000)
+ * -u  Users (default 100)
+ * -t  Transactions each user does (default 10)
+ * -k  Keep the scenario already in the directory, rather than generating one
+ * -j, -W, -A, -P, -Q, -M and -C are as for fastclone.
+ ***********************************************************************
+ * The seed script has a think time every 50 lines, and each other line has
+ * its substitutions, spread over the data files and their columns; one in
+ * eight takes a fresh row. Data values are re-used, so that the data files
+ * stay the same size from one run to the next.
+ *
+ * Generating the scenario comes first, then the phases fastclone goes
+ * through. For each, the elapsed time, the bytes it deals with (the scenario
+ * written, the script, the def file, the script again, the data files, the
+ * script once more, the scripts written, and the data files), the rate, and
+ * the peak resident set size so far are reported.
+ *
+ * This file takes in fastclone.c whole, so as to get at its phases.
+ */
+#define FC_BENCH
+#include "fastclone.c"
+#include <sys/resource.h>
+static char * bench_usage = "Option -h outputs this message.\n\
+Options -l lines, -s substitutions per line, -w line width, -f data files,\n\
+-c columns, -r rows, -u users and -t transactions set the scale.\n\
+Option -k uses the scenario already in the directory.\n\
+Options -j, -W, -A, -P, -Q, -M and -C are as for fastclone.\n\
+Parameter should be:\n\
+ 1 - Directory for the scenario\n";
+struct bench_scale {
+    int lines;
+    int subs;
+    int width;
+    int files;
+    int cols;
+    int rows;
+    int users;
+    int trans;
+};
+/*
+ * Write the seed script, the def file and the data files
+ */
+static int gen_scenario(dir, bsp)
+char * dir;
+struct bench_scale * bsp;
+{
+char * fname;
+FILE * sfp;
+FILE * dfp;
+int i;
+int j;
+int k;
+int n;
+
+    fname = (char *) malloc(strlen(dir) + 40);
+    sprintf(fname, "%s/scripts", dir);
+    mkdir(fname, 0777);
+    sprintf(fname, "%s/scripts/bench", dir);
+    mkdir(fname, 0777);
+    sprintf(fname, "%s/data", dir);
+    mkdir(fname, 0777);
+    sprintf(fname, "%s/out", dir);
+    mkdir(fname, 0777);
+    sprintf(fname, "%s/scripts/bench/bench.msg", dir);
+    if ((sfp = fopen(fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("fopen()");
+        free(fname);
+        return 0;
+    }
+    sprintf(fname, "%s/scripts/bench/bench.def", dir);
+    if ((dfp = fopen(fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("fopen()");
+        fclose(sfp);
+        free(fname);
+        return 0;
+    }
+    for (i = 1; i <= bsp->lines; i++)
+    {
+        if (i % 50 == 0)
+        {
+            fputs("\\W2\\\n", sfp);
+            continue;
+        }
+        n = fprintf(sfp, "L%07d", i);
+        for (j = 0; j < bsp->subs; j++)
+        {
+            n += fprintf(sfp, " k%d=T%07d%03d", j, i, j);
+            fprintf(dfp, "%d|T%07d%03d|bench%d|C%d|%s\n", i, i, j,
+                      (i + j) % bsp->files, (i * bsp->subs + j) % bsp->cols,
+                      ((i + j) % 8 == 0) ? "F" : "");
+        }
+        for (; n < bsp->width; n++)
+            putc('x', sfp);
+        putc('\n', sfp);
+    }
+    fclose(sfp);
+    fclose(dfp);
+    for (k = 0; k < bsp->files; k++)
+    {
+        sprintf(fname, "%s/data/bench%d.db", dir, k);
+        if ((dfp = fopen(fname, "wb")) == NULL)
+        {
+            fprintf(stderr, "Failed to open %s for write\n", fname);
+            perror("fopen()");
+            free(fname);
+            return 0;
+        }
+        for (j = 0; j < bsp->cols; j++)
+            fprintf(dfp, (j == 0) ? "C%d" : "|C%d", j);
+        putc('\n', dfp);
+        for (i = 0; i < bsp->rows; i++)
+        {
+            for (j = 0; j < bsp->cols; j++)
+                fprintf(dfp, (j == 0) ? "v%d_%d" : "|v%d_%d", k,
+                          i * bsp->cols + j);
+            putc('\n', dfp);
+        }
+        fclose(dfp);
+    }
+    free(fname);
+    return 1;
+}
+/*
+ * The size of a file, or of all the data files of a scenario
+ */
+static long long file_size(fname)
+char * fname;
+{
+struct stat st;
+
+    return (stat(fname, &st) < 0) ? 0 : (long long) st.st_size;
+}
+static long long data_size(scp)
+struct scenario * scp;
+{
+struct file_control * fcp;
+long long tot;
+
+    for (tot = 0, fcp = scp->data_anchor; fcp != NULL; fcp = fcp->next_file)
+        tot += file_size(fcp->fname);
+    return tot;
+}
+/*
+ * The size of the scenario gen_scenario() wrote; the script, the def file,
+ * and the data files
+ */
+static long long scenario_size(dir, bsp)
+char * dir;
+struct bench_scale * bsp;
+{
+char * fname;
+long long tot;
+int k;
+
+    fname = (char *) malloc(strlen(dir) + 40);
+    sprintf(fname, "%s/scripts/bench/bench.msg", dir);
+    tot = file_size(fname);
+    sprintf(fname, "%s/scripts/bench/bench.def", dir);
+    tot += file_size(fname);
+    for (k = 0; k < bsp->files; k++)
+    {
+        sprintf(fname, "%s/data/bench%d.db", dir, k);
+        tot += file_size(fname);
+    }
+    free(fname);
+    return tot;
+}
+/*
+ * Report on a phase, and start the clock on the next
+ */
+static double phase_started;
+static void phase_done(name, bytes)
+char * name;
+long long bytes;
+{
+struct rusage ru;
+double elapsed = fc_now() - phase_started;
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%-28s %10.3f %10.2f %10.2f %10.1f\n", name, elapsed,
+              ((double) bytes)/1048576.0,
+              (elapsed > 0.0) ? ((double) bytes)/(1048576.0 * elapsed) : 0.0,
+              ((double) ru.ru_maxrss)/1024.0);
+    fflush(stdout);
+    phase_started = fc_now();
+    return;
+}
+int main(argc, argv)
+int argc;
+char ** argv;
+{
+struct scenario sc;
+struct write_control * wcp;
+struct bench_scale bs;
+char nusers[16];
+char ntrans[16];
+int keep_flag = 0;
+int c;
+char * dir;
+long long script_bytes;
+double started;
+
+    memset((unsigned char *) &sc, 0, sizeof(sc));
+    sc.nthreads = 1;
+    sc.pipe_depth = 8;
+    sc.no_cache = 1;
+    sc.var_flag = 1;
+    sc.reuse_flag = 1;
+    sc.pid = "bench";
+    bs.lines = 10000;
+    bs.subs = 2;
+    bs.width = 80;
+    bs.files = 4;
+    bs.cols = 6;
+    bs.rows = 100000;
+    bs.users = 100;
+    bs.trans = 10;
+    while ((c = getopt(argc, argv, "hl:s:w:f:c:r:u:t:kj:WAP:Q:M:C")) != EOF)
+    {
+        switch (c)
+        {
+        case 'l':
+            bs.lines = atoi(optarg);
+            break;
+        case 's':
+            bs.subs = atoi(optarg);
+            break;
+        case 'w':
+            bs.width = atoi(optarg);
+            break;
+        case 'f':
+            bs.files = atoi(optarg);
+            break;
+        case 'c':
+            bs.cols = atoi(optarg);
+            break;
+        case 'r':
+            bs.rows = atoi(optarg);
+            break;
+        case 'u':
+            bs.users = atoi(optarg);
+            break;
+        case 't':
+            bs.trans = atoi(optarg);
+            break;
+        case 'k':
+            keep_flag = 1;
+            break;
+        case 'j':
+            sc.nthreads = atoi(optarg);
+            break;
+        case 'W':
+            sc.out_mode = OUT_WRITEV;
+            break;
+        case 'A':
+            sc.archive_flag = 1;
+            break;
+        case 'P':
+            sc.pipe_writers = atoi(optarg);
+            break;
+        case 'Q':
+            sc.pipe_depth = atoi(optarg);
+            break;
+        case 'M':
+            sc.max_mem = mem_size(optarg);
+            break;
+        case 'C':
+            sc.cursor_flag = 1;
+            break;
+        case 'h':
+        default:
+            fputs(bench_usage, stderr);
+            exit(1);
+        }
+    }
+    if (argc - optind < 1)
+    {
+        fputs("Too few parameters\n", stderr);
+        fputs(bench_usage, stderr);
+        exit(1);
+    }
+    if (bs.lines < 1 || bs.subs < 0 || bs.files < 1 || bs.cols < 1
+     || bs.rows < 1 || bs.users < 1 || bs.trans < 1 || sc.nthreads < 1
+     || sc.pipe_depth < 1)
+    {
+        fputs("Illegal scale\n", stderr);
+        fputs(bench_usage, stderr);
+        exit(1);
+    }
+/*
+ * The data file names are made from the directory, and we go in to out to
+ * write the scripts, so it must be absolute.
+ */
+    mkdir(argv[optind], 0777);
+    if (argv[optind][0] == '/')
+        dir = argv[optind];
+    else
+    {
+        dir = (char *) malloc(4096 + strlen(argv[optind]));
+        if (getcwd(dir, 4096) == NULL)
+        {
+            perror("getcwd()");
+            exit(1);
+        }
+        strcat(dir, "/");
+        strcat(dir, argv[optind]);
+    }
+    path_home = dir;
+    path_ext = "msg";
+    if (!keep_flag)
+        printf("lines=%d subs=%d width=%d files=%d cols=%d rows=%d\n",
+              bs.lines, bs.subs, bs.width, bs.files, bs.cols, bs.rows);
+    printf("users=%d trans=%d\n", bs.users, bs.trans);
+    printf("%-28s %10s %10s %10s %10s\n", "Phase", "Seconds", "MB", "MB/s",
+              "Peak RSS MB");
+    started = phase_started = fc_now();
+    if (!keep_flag)
+    {
+        if (!gen_scenario(dir, &bs))
+            exit(1);
+        phase_done("generate", scenario_size(dir, &bs));
+    }
+/*
+ * Now the phases, as clone_scenario() and new_bundle() do them
+ */
+    wcp = (struct write_control *) calloc(1, sizeof(struct write_control));
+    wcp->scp = &sc;
+    wcp->var_flag = sc.var_flag;
+    sprintf(nusers, "%d", bs.users);
+    sprintf(ntrans, "%d", bs.trans);
+    if (!bundle_numbers(wcp, "1", nusers, ntrans, "2")
+     || !load_script(wcp, "bench"))
+        exit(1);
+    script_bytes = wcp->script_len;
+    phase_done("get_script", script_bytes);
+    load_def(wcp);
+    phase_done("get_def", file_size(wcp->def_file.fname));
+    if (chdir(dir) < 0 || chdir("out") < 0)
+    {
+        fprintf(stderr, "Cannot get in to %s/out\n", dir);
+        perror("chdir()");
+        exit(1);
+    }
+    scan_scripts(&sc, &wcp, 1);
+    phase_done("scan_scripts", script_bytes);
+    collect_needed_data(&sc, &wcp, 1);
+    phase_done("collect_needed_data", data_size(&sc));
+    assemble_clone_instructions(wcp, wcp->think_time_buf);
+    phase_done("assemble_clone_instructions", script_bytes);
+    phase_done("do_the_clone", (long long) do_the_clone(wcp));
+    final_data_tidy(&sc);
+    phase_done("final_data_tidy", data_size(&sc));
+    phase_started = started;
+    phase_done("total", 0);
+    exit((sc.write_errors > 0) ? 1 : 0);
+}
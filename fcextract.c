@@ -0,0 +1,127 @@
+/*
+ * fcextract.c - get users' scripts back out of a fastclone archive
+ ***********************************************************************
+ * Parameters
+ * 1 - The archive (echo<pid>.<bundle>.fca)
+ * 2 onwards - The users wanted, numbered from 0
+ * Options:
+ * -l  List the users in the archive, with where their scripts are.
+ * -x  Write each user's script to the file fastclone would have written it
+ *     to without -A (the archive name without the .fca, then .user), rather
+ *     than to stdout. With no users given, all of them are written.
+ ***********************************************************************
+ */
+static char * sccs_id =  "@(#) $Name$ $Id$\n\
+Copyright (c) E2 Systems Limited 2009\n";
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef LCC
+#include <unistd.h>
+#endif
+#include "fcarch.h"
+extern int optind;
+extern char * optarg;
+static char * usage = "Option -h outputs this message.\n\
+Option -l lists the users in the archive.\n\
+Option -x writes each user's script to its own echo file, rather than stdout;\n\
+all of them if no users are given.\n\
+Parameters should be:\n\
+ 1 - The archive\n\
+ 2 onwards - The users wanted (from 0)\n";
+/*
+ * Write out one user's script; returns 0 if it could not be done.
+ */
+static int extract_user(fap, user, stem)
+struct fc_archive * fap;
+int user;
+char * stem;
+{
+char * fname;
+FILE * ofp;
+int ret;
+
+    if (stem == NULL)
+        ofp = stdout;
+    else
+    {
+        fname = (char *) malloc(strlen(stem) + 12);
+        sprintf(fname, "%s.%d", stem, user);
+        if ((ofp = fopen(fname, "wb")) == NULL)
+        {
+            fprintf(stderr, "Failed to open %s for write\n", fname);
+            perror("fopen()");
+            free(fname);
+            return 0;
+        }
+        free(fname);
+    }
+    if (!(ret = (fca_copy(fap, user, ofp) >= 0)))
+        fprintf(stderr, "Could not extract user %d from %s\n", user,
+                     fap->fname);
+    if (stem != NULL)
+        fclose(ofp);
+    return ret;
+}
+int main(argc, argv)
+int argc;
+char ** argv;
+{
+struct fc_archive * fap;
+char * stem = NULL;
+int list_flag = 0;
+int extract_flag = 0;
+long long off;
+long long len;
+int errors = 0;
+int user;
+int i;
+
+    while ((i = getopt(argc, argv, "hlx")) != EOF)
+    {
+        switch (i)
+        {
+        case 'l':
+            list_flag = 1;
+            break;
+        case 'x':
+            extract_flag = 1;
+            break;
+        case 'h':
+        default:
+            fputs(usage, stderr);
+            exit(1);
+        }
+    }
+    if (argc - optind < ((list_flag || extract_flag) ? 1 : 2))
+    {
+        fputs("Too few parameters\n", stderr);
+        fputs(usage, stderr);
+        exit(1);
+    }
+    if ((fap = fca_open(argv[optind])) == NULL)
+        exit(1);
+    if (list_flag)
+    {
+        for (user = 0; user < fap->nusers; user++)
+            if (fca_find(fap, user, &off, &len))
+                printf("%d|%lld|%lld\n", user, off, len);
+    }
+    if (extract_flag)
+    {
+        stem = strdup(argv[optind]);
+        if ((i = strlen(stem)) > 4 && !strcmp(stem + i - 4, ".fca"))
+            stem[i - 4] = '\0';
+        if (argc - optind < 2)
+            for (user = 0; user < fap->nusers; user++)
+                errors += !extract_user(fap, user, stem);
+    }
+    for (i = optind + 1; i < argc; i++)
+    {
+        user = atoi(argv[i]);
+        errors += !extract_user(fap, user, stem);
+    }
+    fca_close(fap);
+    exit((errors > 0) ? 1 : 0);
+}
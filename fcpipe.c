@@ -0,0 +1,589 @@
+/************************************************************************
+ * fcpipe.c - Pipelined writing of cloned scripts
+ *
+ * Rendering a script is all CPU; writing it is all waiting, for the disk or,
+ * worse, for a network file system. Done in line, on the same thread, neither
+ * is ever kept fully busy. Here the renderers copy the script text in to
+ * large buffers from a pool, and one or more writer threads write them out.
+ *
+ * A writer uses io_uring if the kernel has it. The calls are made directly,
+ * so no liburing is needed; the rings are mapped, writes are queued on the
+ * submission ring, and completions are picked up off the completion ring.
+ * This keeps up to the queue depth of writes in flight for each writer. If
+ * io_uring cannot be set up, or gives out part way, the writer uses pwrite(),
+ * a buffer at a time.
+ *
+ * The buffers for a file can be written in any order, since each knows its
+ * offset.
+ */
+static char * sccs_id =  "@(#) $Name$ $Id$\n\
+Copyright (c) E2 Systems Limited 2009\n";
+#ifdef LINUX
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "fcpipe.h"
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+static double fcp_now()
+{
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec)/1000000000.0;
+}
+#define GUARD(pp)  ((pthread_mutex_t *) (pp)->guard)
+#define READY(pp)  ((pthread_cond_t *) (pp)->work_ready)
+#define FREED(pp)  ((pthread_cond_t *) (pp)->buf_free)
+/*
+ * Write a buffer with pwrite(), from done bytes in; returns 0 if it fails.
+ */
+static int fcp_pwrite(bp, done)
+struct fcp_buf * bp;
+unsigned int done;
+{
+ssize_t n;
+
+    while (done < bp->len)
+    {
+        if ((n = pwrite(bp->fop->fd, bp->data + done, bp->len - done,
+                     (off_t) (bp->off + done))) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to write %s\n", bp->fop->fname);
+            perror("pwrite()");
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+static void fcp_close_file(fop)
+struct fcp_file * fop;
+{
+    if (close(fop->fd) < 0)
+    {
+        fprintf(stderr, "Failed to close %s\n", fop->fname);
+        perror("close()");
+    }
+    free(fop->fname);
+    free(fop);
+    return;
+}
+/*
+ * A buffer has been written; put it back in the pool, and close its file if
+ * that was the last of it.
+ */
+static void fcp_release(pp, bp, ok)
+struct fc_pipe * pp;
+struct fcp_buf * bp;
+int ok;
+{
+struct fcp_file * fop = bp->fop;
+int close_now;
+
+    pthread_mutex_lock(GUARD(pp));
+    if (ok)
+    {
+        pp->stats.bufs++;
+        pp->stats.bytes += bp->len;
+    }
+    else
+        pp->stats.errors++;
+    close_now = (--fop->pending == 0 && fop->done);
+    bp->next = pp->free_list;
+    pp->free_list = bp;
+    pthread_cond_signal(FREED(pp));
+    pthread_mutex_unlock(GUARD(pp));
+    if (close_now)
+        fcp_close_file(fop);
+    return;
+}
+/*
+ * Take up to max buffers off the queue, waiting for some if wait is set.
+ * Returns NULL, if waiting, only when the pipe is being finished and there is
+ * nothing left.
+ */
+static struct fcp_buf * fcp_take(pp, max, wait)
+struct fc_pipe * pp;
+int max;
+int wait;
+{
+struct fcp_buf * chain;
+struct fcp_buf * bp;
+double started;
+
+    pthread_mutex_lock(GUARD(pp));
+    if (pp->head == NULL && wait && !pp->finishing)
+    {
+        started = fcp_now();
+        while (pp->head == NULL && !pp->finishing)
+            pthread_cond_wait(READY(pp), GUARD(pp));
+        pp->stats.writer_idle += fcp_now() - started;
+    }
+    for (chain = pp->head, bp = NULL; max > 0 && pp->head != NULL; max--)
+    {
+        bp = pp->head;
+        pp->head = bp->next;
+        pp->queued--;
+    }
+    if (bp != NULL)
+        bp->next = NULL;
+    else
+        chain = NULL;
+    if (pp->head == NULL)
+        pp->tail = NULL;
+    pthread_mutex_unlock(GUARD(pp));
+    return chain;
+}
+#ifdef __NR_io_uring_setup
+/*
+ * An io_uring, as seen from our side
+ */
+struct fcp_uring {
+    int fd;
+    unsigned int * sq_head;
+    unsigned int * sq_tail;
+    unsigned int * sq_mask;
+    unsigned int * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned int * cq_head;
+    unsigned int * cq_tail;
+    unsigned int * cq_mask;
+    struct io_uring_cqe * cqes;
+    unsigned char * sq_ring;
+    size_t sq_len;
+    unsigned char * cq_ring;
+    size_t cq_len;
+    size_t sqes_len;
+};
+static void uring_free(up)
+struct fcp_uring * up;
+{
+    if (up->sqes != NULL && up->sqes != MAP_FAILED)
+        munmap(up->sqes, up->sqes_len);
+    if (up->cq_ring != NULL && up->cq_ring != MAP_FAILED
+     && up->cq_ring != up->sq_ring)
+        munmap(up->cq_ring, up->cq_len);
+    if (up->sq_ring != NULL && up->sq_ring != MAP_FAILED)
+        munmap(up->sq_ring, up->sq_len);
+    if (up->fd >= 0)
+        close(up->fd);
+    free(up);
+    return;
+}
+/*
+ * Set up a ring with room for depth writes. Returns NULL, without saying
+ * anything, if the kernel will not let us have one.
+ */
+static struct fcp_uring * uring_new(depth)
+int depth;
+{
+struct fcp_uring * up;
+struct io_uring_params p;
+
+    up = (struct fcp_uring *) calloc(1, sizeof(struct fcp_uring));
+    memset((char *) &p, 0, sizeof(p));
+    if ((up->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0)
+    {
+        free(up);
+        return NULL;
+    }
+    up->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    up->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (up->cq_len > up->sq_len)
+            up->sq_len = up->cq_len;
+        up->cq_len = up->sq_len;
+    }
+    up->sq_ring = (unsigned char *) mmap(NULL, up->sq_len,
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, up->fd,
+                  IORING_OFF_SQ_RING);
+    if (up->sq_ring == (unsigned char *) MAP_FAILED)
+    {
+        uring_free(up);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        up->cq_ring = up->sq_ring;
+    else
+    if ((up->cq_ring = (unsigned char *) mmap(NULL, up->cq_len,
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, up->fd,
+                  IORING_OFF_CQ_RING)) == (unsigned char *) MAP_FAILED)
+    {
+        uring_free(up);
+        return NULL;
+    }
+    up->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if ((up->sqes = (struct io_uring_sqe *) mmap(NULL, up->sqes_len,
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, up->fd,
+                  IORING_OFF_SQES)) == (struct io_uring_sqe *) MAP_FAILED)
+    {
+        uring_free(up);
+        return NULL;
+    }
+    up->sq_head = (unsigned int *) (up->sq_ring + p.sq_off.head);
+    up->sq_tail = (unsigned int *) (up->sq_ring + p.sq_off.tail);
+    up->sq_mask = (unsigned int *) (up->sq_ring + p.sq_off.ring_mask);
+    up->sq_array = (unsigned int *) (up->sq_ring + p.sq_off.array);
+    up->cq_head = (unsigned int *) (up->cq_ring + p.cq_off.head);
+    up->cq_tail = (unsigned int *) (up->cq_ring + p.cq_off.tail);
+    up->cq_mask = (unsigned int *) (up->cq_ring + p.cq_off.ring_mask);
+    up->cqes = (struct io_uring_cqe *) (up->cq_ring + p.cq_off.cqes);
+    return up;
+}
+/*
+ * Queue a write of a buffer. The kernel has the iovec by the time
+ * io_uring_enter() returns, but it is kept with the buffer anyway.
+ */
+static void uring_queue(up, bp, iov)
+struct fcp_uring * up;
+struct fcp_buf * bp;
+struct iovec * iov;
+{
+unsigned int tail = *up->sq_tail;
+unsigned int idx = tail & *up->sq_mask;
+struct io_uring_sqe * sqe = &up->sqes[idx];
+
+    iov->iov_base = bp->data;
+    iov->iov_len = bp->len;
+    memset((char *) sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = bp->fop->fd;
+    sqe->off = bp->off;
+    sqe->addr = (unsigned long) iov;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long) bp;
+    up->sq_array[idx] = idx;
+    __atomic_store_n(up->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return;
+}
+/*
+ * Pick up the writes that have finished, and return how many there were.
+ * Anything short, or that the kernel would not do this way, is finished off
+ * with pwrite().
+ */
+static int uring_reap(pp, up, flying)
+struct fc_pipe * pp;
+struct fcp_uring * up;
+char * flying;
+{
+struct io_uring_cqe * cqe;
+struct fcp_buf * bp;
+unsigned int head;
+int n;
+
+    for (n = 0, head = *up->cq_head;
+            head != __atomic_load_n(up->cq_tail, __ATOMIC_ACQUIRE);
+                head++, n++)
+    {
+        cqe = &up->cqes[head & *up->cq_mask];
+        bp = (struct fcp_buf *) (unsigned long) cqe->user_data;
+        flying[bp - pp->bufs] = 0;
+        if (cqe->res < 0)
+            fcp_release(pp, bp, fcp_pwrite(bp, 0));
+        else
+        if (cqe->res < bp->len)
+            fcp_release(pp, bp, fcp_pwrite(bp, cqe->res));
+        else
+            fcp_release(pp, bp, 1);
+    }
+    __atomic_store_n(up->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+/*
+ * Write the buffers handed over, keeping up to the depth in flight, until
+ * the pipe is finished. Returns 0 if the ring gives out first; the writes
+ * then carry on with pwrite().
+ */
+static int uring_writer(pp, up)
+struct fc_pipe * pp;
+struct fcp_uring * up;
+{
+struct iovec * iovs;
+struct fcp_buf * chain;
+char * flying;
+int inflight = 0;
+int most = 0;
+int to_submit;
+int ok;
+int i;
+
+    iovs = (struct iovec *) malloc(sizeof(struct iovec) * pp->nbufs);
+    flying = (char *) calloc(pp->nbufs, sizeof(char));
+    for (ok = 1; ok;)
+    {
+        chain = (inflight < pp->depth) ?
+                    fcp_take(pp, pp->depth - inflight, (inflight == 0)) : NULL;
+        if (chain == NULL && inflight == 0)
+            break;
+        for (to_submit = 0; chain != NULL; chain = chain->next, to_submit++)
+        {
+            uring_queue(up, chain, &iovs[chain - pp->bufs]);
+            flying[chain - pp->bufs] = 1;
+        }
+        if ((inflight += to_submit) > most)
+            most = inflight;
+/*
+ * Only wait for a write to finish if there is nothing else for us to do
+ */
+        while (syscall(__NR_io_uring_enter, up->fd, to_submit,
+                    (to_submit == 0 || inflight >= pp->depth) ? 1 : 0,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            perror("io_uring_enter()");
+            fputs("Carrying on with pwrite()\n", stderr);
+            ok = 0;
+            break;
+        }
+        inflight -= uring_reap(pp, up, flying);
+    }
+/*
+ * Whatever has not come back is written again with pwrite(); it is the same
+ * data in the same place, whether or not the kernel got any of it done.
+ */
+    if (!ok)
+    {
+        for (i = 0; i < pp->nbufs; i++)
+            if (flying[i])
+                fcp_release(pp, &pp->bufs[i], fcp_pwrite(&pp->bufs[i], 0));
+    }
+    pthread_mutex_lock(GUARD(pp));
+    if (most > pp->stats.inflight_max)
+        pp->stats.inflight_max = most;
+    pthread_mutex_unlock(GUARD(pp));
+    free(flying);
+    free(iovs);
+    return ok;
+}
+#endif
+static void * fcp_writer(arg)
+void * arg;
+{
+struct fc_pipe * pp = (struct fc_pipe *) arg;
+struct fcp_buf * bp;
+#ifdef __NR_io_uring_setup
+struct fcp_uring * up;
+int ok;
+
+    if (pp->depth > 1 && (up = uring_new(pp->depth)) != NULL)
+    {
+        pthread_mutex_lock(GUARD(pp));
+        pp->stats.uring++;
+        pthread_mutex_unlock(GUARD(pp));
+        ok = uring_writer(pp, up);
+        uring_free(up);
+        if (ok)
+            return NULL;
+    }
+#endif
+    while ((bp = fcp_take(pp, 1, 1)) != NULL)
+        fcp_release(pp, bp, fcp_pwrite(bp, 0));
+    pthread_mutex_lock(GUARD(pp));
+    if (pp->stats.inflight_max < 1)
+        pp->stats.inflight_max = 1;
+    pthread_mutex_unlock(GUARD(pp));
+    return NULL;
+}
+/*
+ * Set up a pipe with nwriters writers, each with up to depth writes in
+ * flight, for nrenderers renderers to feed with buffers of buf_size. There
+ * are enough buffers for the writers to be busy and the renderers each to
+ * have one on the go.
+ */
+struct fc_pipe * fcp_new(nwriters, depth, buf_size, nrenderers)
+int nwriters;
+int depth;
+unsigned int buf_size;
+int nrenderers;
+{
+struct fc_pipe * pp;
+int i;
+
+    pp = (struct fc_pipe *) calloc(1, sizeof(struct fc_pipe));
+    pp->nwriters = (nwriters < 1) ? 1 : nwriters;
+    pp->depth = (depth < 1) ? 1 : depth;
+    pp->buf_size = buf_size;
+    pp->nbufs = 2 * pp->nwriters * pp->depth + nrenderers;
+    if ((pp->space = (unsigned char *) malloc(((size_t) pp->nbufs) *
+                   buf_size)) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate %d buffers of %u bytes\n",
+                  pp->nbufs, buf_size);
+        free(pp);
+        return NULL;
+    }
+    pp->bufs = (struct fcp_buf *) calloc(pp->nbufs, sizeof(struct fcp_buf));
+    for (i = 0; i < pp->nbufs; i++)
+    {
+        pp->bufs[i].data = pp->space + ((size_t) i) * buf_size;
+        pp->bufs[i].next = pp->free_list;
+        pp->free_list = &pp->bufs[i];
+    }
+    pp->guard = malloc(sizeof(pthread_mutex_t));
+    pp->work_ready = malloc(sizeof(pthread_cond_t));
+    pp->buf_free = malloc(sizeof(pthread_cond_t));
+    pthread_mutex_init(GUARD(pp), NULL);
+    pthread_cond_init(READY(pp), NULL);
+    pthread_cond_init(FREED(pp), NULL);
+    pp->tids = malloc(sizeof(pthread_t) * pp->nwriters);
+    for (i = 0; i < pp->nwriters; i++)
+        if (pthread_create(&((pthread_t *) pp->tids)[i], NULL, fcp_writer,
+                   pp))
+        {
+            perror("pthread_create()");
+            break;
+        }
+    if ((pp->nwriters = i) == 0)
+    {
+        fcp_finish(pp, NULL);
+        return NULL;
+    }
+    return pp;
+}
+/*
+ * Open a file to be written through the pipe. A file that cannot be opened
+ * counts as an error, like a buffer that cannot be written.
+ */
+struct fcp_file * fcp_open(pp, fname)
+struct fc_pipe * pp;
+char * fname;
+{
+struct fcp_file * fop;
+int fd;
+
+    if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        fprintf(stderr, "Failed to open %s for write\n", fname);
+        perror("open()");
+        pthread_mutex_lock(GUARD(pp));
+        pp->stats.errors++;
+        pthread_mutex_unlock(GUARD(pp));
+        return NULL;
+    }
+    fop = (struct fcp_file *) calloc(1, sizeof(struct fcp_file));
+    fop->fd = fd;
+    fop->fname = strdup(fname);
+    return fop;
+}
+/*
+ * The renderer has finished with a file; it is closed once it is written
+ */
+void fcp_close(pp, fop)
+struct fc_pipe * pp;
+struct fcp_file * fop;
+{
+int close_now;
+
+    pthread_mutex_lock(GUARD(pp));
+    fop->done = 1;
+    close_now = (fop->pending == 0);
+    pthread_mutex_unlock(GUARD(pp));
+    if (close_now)
+        fcp_close_file(fop);
+    return;
+}
+/*
+ * Get an empty buffer for off in a file, waiting for one if need be
+ */
+struct fcp_buf * fcp_get(pp, fop, off)
+struct fc_pipe * pp;
+struct fcp_file * fop;
+long long off;
+{
+struct fcp_buf * bp;
+double started;
+
+    pthread_mutex_lock(GUARD(pp));
+    if (pp->free_list == NULL)
+    {
+        started = fcp_now();
+        while (pp->free_list == NULL)
+            pthread_cond_wait(FREED(pp), GUARD(pp));
+        pp->stats.render_stall += fcp_now() - started;
+    }
+    bp = pp->free_list;
+    pp->free_list = bp->next;
+    pthread_mutex_unlock(GUARD(pp));
+    bp->fop = fop;
+    bp->off = off;
+    bp->len = 0;
+    bp->next = NULL;
+    return bp;
+}
+/*
+ * Hand a buffer over to be written. An empty one just goes back in the pool.
+ */
+void fcp_put(pp, bp)
+struct fc_pipe * pp;
+struct fcp_buf * bp;
+{
+    pthread_mutex_lock(GUARD(pp));
+    if (bp->len == 0)
+    {
+        bp->next = pp->free_list;
+        pp->free_list = bp;
+        pthread_cond_signal(FREED(pp));
+    }
+    else
+    {
+        bp->fop->pending++;
+        if (pp->tail == NULL)
+            pp->head = bp;
+        else
+            pp->tail->next = bp;
+        pp->tail = bp;
+        pp->queued++;
+        pp->stats.queued_sum += pp->queued;
+        if (pp->queued > pp->stats.queued_max)
+            pp->stats.queued_max = pp->queued;
+        pthread_cond_signal(READY(pp));
+    }
+    pthread_mutex_unlock(GUARD(pp));
+    return;
+}
+/*
+ * Wait for everything handed over to be written, and get rid of the pipe.
+ * How it went is copied to sp, if it is given.
+ */
+void fcp_finish(pp, sp)
+struct fc_pipe * pp;
+struct fcp_stats * sp;
+{
+int i;
+
+    pthread_mutex_lock(GUARD(pp));
+    pp->finishing = 1;
+    pthread_cond_broadcast(READY(pp));
+    pthread_mutex_unlock(GUARD(pp));
+    for (i = 0; i < pp->nwriters; i++)
+        pthread_join(((pthread_t *) pp->tids)[i], NULL);
+    if (sp != NULL)
+        *sp = pp->stats;
+    pthread_mutex_destroy(GUARD(pp));
+    pthread_cond_destroy(READY(pp));
+    pthread_cond_destroy(FREED(pp));
+    free(pp->guard);
+    free(pp->work_ready);
+    free(pp->buf_free);
+    free(pp->tids);
+    free(pp->bufs);
+    free(pp->space);
+    free(pp);
+    return;
+}
+#endif
@@ -0,0 +1,74 @@
+/************************************************************************
+ * fcpipe.h - Pipelined writing of cloned scripts
+ *
+ * The threads rendering the scripts fill buffers taken from a pool, and hand
+ * them over to writer threads, which write them out at the offsets they were
+ * given and put them back in the pool. Rendering then never waits on the disk,
+ * unless the writers fall so far behind that the pool runs dry.
+ *
+ * The writers use io_uring where the kernel has it, keeping up to the queue
+ * depth of writes in flight each; otherwise, or if the ring gives out, they
+ * use pwrite().
+ *
+ * Linux only.
+ *
+ * @(#) $Name$ $Id$ Copyright (c) E2 Systems Limited 2009
+ */
+#ifndef FCPIPE_H
+#define FCPIPE_H
+/*
+ * A file being written through the pipe. It is closed once the renderer has
+ * finished with it and the last of its buffers has been written.
+ */
+struct fcp_file {
+    int fd;
+    int pending;                /* Buffers handed over but not yet written  */
+    int done;                   /* Whether the renderer has finished with it */
+    char * fname;
+};
+struct fcp_buf {
+    struct fcp_file * fop;
+    long long off;              /* Where in the file it goes                */
+    unsigned int len;
+    unsigned char * data;
+    struct fcp_buf * next;
+};
+/*
+ * How the pipe got on, for tuning the numbers of writers and the depth
+ */
+struct fcp_stats {
+    int uring;                  /* Writers using io_uring                   */
+    long long bufs;             /* Buffers written                          */
+    long long bytes;
+    long long queued_sum;       /* Buffers waiting, summed at each hand over */
+    int queued_max;
+    int inflight_max;           /* Most writes one writer had in flight     */
+    double render_stall;        /* Seconds renderers waited for a buffer    */
+    double writer_idle;         /* Seconds writers waited for work          */
+    int errors;                 /* Files not opened, buffers not written    */
+};
+struct fc_pipe {
+    int nwriters;
+    int depth;                  /* Writes each writer may have in flight    */
+    unsigned int buf_size;
+    int nbufs;
+    unsigned char * space;      /* All the buffers' data                    */
+    struct fcp_buf * bufs;
+    struct fcp_buf * free_list;
+    struct fcp_buf * head;      /* Waiting to be written, oldest first      */
+    struct fcp_buf * tail;
+    int queued;
+    int finishing;
+    void * guard;
+    void * work_ready;
+    void * buf_free;
+    void * tids;
+    struct fcp_stats stats;
+};
+struct fc_pipe * fcp_new();
+struct fcp_file * fcp_open();
+void fcp_close();
+struct fcp_buf * fcp_get();
+void fcp_put();
+void fcp_finish();
+#endif
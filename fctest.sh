@@ -0,0 +1,53 @@
+#!/bin/sh
+# fctest.sh
+# Checks that fastclone -c counts the rows wanted before any of the data
+# files exist, as it is used to find out how many rows to prepare; and that
+# the count is the same once they do. Run from the build directory.
+FC=`pwd`/fastclone
+PATH_HOME=${TMPDIR:-/tmp}/fctest.$$
+PATH_EXT=msg
+export PATH_HOME PATH_EXT
+trap 'rm -rf $PATH_HOME' 0
+mkdir -p $PATH_HOME/scripts/s $PATH_HOME/data
+cat > $PATH_HOME/scripts/s/s.msg <<'EOF'
+GET /login?user=ALICE&pw=SECRET HTTP/1.1
+\W5\
+POST /order?cust=CUST001&item=ITEM9 HTTP/1.1
+EOF
+cat > $PATH_HOME/scripts/s/s.def <<'EOF'
+1|ALICE|users|NAME|F
+1|SECRET|users|PASS|
+3|CUST001|cust|CID|F
+3|ITEM9|items|ITEM|
+EOF
+#
+# Three users doing two transactions each; every transaction takes a row for
+# each 'F' substitution, and one more from each file for the bump at the end
+#
+cat > $PATH_HOME/want <<EOF
+$PATH_HOME/data/users.db|12
+$PATH_HOME/data/cust.db|12
+$PATH_HOME/data/items.db|6
+EOF
+failed=0
+cd $PATH_HOME
+if $FC -c s 1 1 3 2 Y 5 N > got 2> err && cmp -s want got && ! test -s err
+then
+    echo "PASS: -c with no data files"
+else
+    echo "FAIL: -c with no data files"
+    cat got err
+    failed=1
+fi
+printf 'NAME|PASS\nalice|pw\n' > data/users.db
+printf 'CID|REGION\nC0001|R1\n' > data/cust.db
+printf 'ITEM|QTY\nI1|1\n' > data/items.db
+if $FC -c s 1 1 3 2 Y 5 N > got 2> err && cmp -s want got && ! test -s err
+then
+    echo "PASS: -c with the data files"
+else
+    echo "FAIL: -c with the data files"
+    cat got err
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,131 @@
+/************************************************************************
+ * fctrace.c - Chrome trace events for a build with -DFC_TRACE; see fctrace.h
+ *
+ * The file is opened by the first span to end, and finished off when the
+ * program exits. The spans from all the threads go in to it, under a lock.
+ */
+static char * sccs_id =  "@(#) $Name$ $Id$\n\
+Copyright (c) E2 Systems Limited 2009\n";
+#ifdef FC_TRACE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef LCC
+#include <unistd.h>
+#endif
+#include "fctrace.h"
+#ifdef LINUX
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+static pthread_mutex_t fct_guard = PTHREAD_MUTEX_INITIALIZER;
+#else
+#include <sys/time.h>
+#endif
+static FILE * fct_fp;
+static int fct_failed;
+static long long fct_events;
+/*
+ * Microseconds, on the same clock as fastclone's timings
+ */
+double fct_now()
+{
+#ifdef LINUX
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec) * 1000000.0 + ((double) ts.tv_nsec)/1000.0;
+#else
+struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((double) tv.tv_sec) * 1000000.0 + (double) tv.tv_usec;
+#endif
+}
+/*
+ * Close the array off, so that the file is strictly JSON
+ */
+static void fct_finish()
+{
+    if (fct_fp != NULL)
+    {
+        fputs("\n]\n", fct_fp);
+        fclose(fct_fp);
+        fct_fp = NULL;
+    }
+    return;
+}
+/*
+ * Open the trace file; returns 0 if it cannot be, in which case tracing is
+ * given up on.
+ */
+static int fct_open()
+{
+char * fname;
+char buf[64];
+
+    if ((fname = getenv("FC_TRACE_FILE")) == NULL)
+    {
+        sprintf(buf, "fctrace.%d.json", (int) getpid());
+        fname = buf;
+    }
+    if ((fct_fp = fopen(fname, "wb")) == NULL)
+    {
+        fprintf(stderr, "Failed to open trace file %s for write\n", fname);
+        perror("fopen()");
+        fct_failed = 1;
+        return 0;
+    }
+    fputs("[", fct_fp);
+    atexit(fct_finish);
+    return 1;
+}
+/*
+ * Write a span that started at started (from fct_now()) and ends now
+ */
+void fct_span(name, detail, n, started)
+char * name;
+char * detail;
+long long n;
+double started;
+{
+double now = fct_now();
+int tid;
+
+#ifdef LINUX
+    tid = (int) syscall(SYS_gettid);
+    pthread_mutex_lock(&fct_guard);
+#else
+    tid = 1;
+#endif
+    if (fct_fp != NULL || (!fct_failed && fct_open()))
+    {
+        fprintf(fct_fp,
+"%s\n{\"name\":\"%s\",\"cat\":\"fc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\
+\"pid\":%d,\"tid\":%d,\"args\":{\"n\":%lld",
+                (fct_events++ > 0) ? "," : "", name, started, now - started,
+                (int) getpid(), tid, n);
+        if (detail != NULL)
+        {
+            fputs(",\"detail\":\"", fct_fp);
+            for (; *detail != '\0'; detail++)
+            {
+                if (*detail == '"' || *detail == '\\')
+                    fprintf(fct_fp, "\\%c", *detail);
+                else
+                if ((unsigned char) *detail < ' ')
+                    fprintf(fct_fp, "\\u%04x", (unsigned char) *detail);
+                else
+                    putc(*detail, fct_fp);
+            }
+            putc('"', fct_fp);
+        }
+        fputs("}}", fct_fp);
+    }
+#ifdef LINUX
+    pthread_mutex_unlock(&fct_guard);
+#endif
+    return;
+}
+#endif
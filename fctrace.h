@@ -0,0 +1,35 @@
+/************************************************************************
+ * fctrace.h - Tracing of the hot paths, in a build with -DFC_TRACE
+ *
+ * Each span traced is written out, as it ends, as a Chrome trace event (a
+ * complete event, ph X), with the thread it was on, a detail string such as
+ * the file name, and a count such as the rows read or the matches found. The
+ * file can be loaded in to chrome://tracing or Perfetto as it stands.
+ *
+ * The events go to the file named by FC_TRACE_FILE in the environment, or to
+ * fctrace.<pid>.json in the current directory. Without -DFC_TRACE the macros
+ * come to nothing, and nothing is traced.
+ *
+ * Usage:
+ *     FCT_DECL(t0)                 (with the other declarations)
+ *     FCT_START(t0);
+ *     ...
+ *     FCT_SPAN("name", detail, count, t0);
+ *
+ * @(#) $Name$ $Id$ Copyright (c) E2 Systems Limited 2009
+ */
+#ifndef FCTRACE_H
+#define FCTRACE_H
+#ifdef FC_TRACE
+double fct_now();
+void fct_span();
+#define FCT_DECL(t) double t;
+#define FCT_START(t) ((t) = fct_now())
+#define FCT_SPAN(name, detail, n, t)\
+        fct_span((name), (char *) (detail), (long long) (n), (t))
+#else
+#define FCT_DECL(t)
+#define FCT_START(t)
+#define FCT_SPAN(name, detail, n, t)
+#endif
+#endif